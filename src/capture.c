@@ -21,23 +21,58 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
 
 #include <errno.h>
 #include <unistd.h>
 #include <limits.h>
 #include <libgen.h>
+#include <time.h>
 #include <sys/un.h>
 #include <sys/socket.h>
 
-static struct {
+
+struct capture_consumer {
     int connfd;
     bool accepted;
-    bool capturing;
     bool no_modifiers;
     bool linear;
     bool map_host;
+    bool paused;
+    bool snapshot;
+    bool snapshot_pending;
+    bool texture_sent;
+    bool frame_dropped;
+    uint8_t held;
+    uint8_t device_uuid[16];
+    struct capture_region region;
+    int ring_size;
+    bool frames;
+    bool has_modifiers;
+    int nmodifiers;
+    int modifiers_size;
+    struct {
+        uint32_t format;
+        uint64_t modifier;
+    } *modifiers;
+};
+
+static struct {
+    struct capture_consumer consumers[CAPTURE_MAX_CONSUMERS];
+    bool capturing;
     bool need_reinit;
+    bool no_modifiers;
+    bool linear;
+    bool map_host;
+    int frame_width;
+    int frame_height;
+    struct capture_region region;
+    int nslots;
+    struct capture_texture_data tdata[CAPTURE_MAX_SLOTS];
+    int fds[CAPTURE_MAX_SLOTS][4];
     uint8_t device_uuid[16];
+    uint8_t driver_uuid[16];
 } data;
 
 static bool get_wine_exe(char *buf, size_t bufsize)
@@ -71,92 +106,327 @@ static bool get_exe(char *buf, size_t bufsize)
     return true;
 }
 
-static bool capture_try_connect()
+static void capture_consumer_region(const struct capture_consumer *c, struct capture_region *r)
+{
+    *r = c->region;
+    if (!r->width || !r->height || r->x >= data.frame_width || r->y >= data.frame_height) {
+        r->x = 0;
+        r->y = 0;
+        r->width = data.frame_width;
+        r->height = data.frame_height;
+        return;
+    }
+    r->width = MIN(r->width, data.frame_width - r->x);
+    r->height = MIN(r->height, data.frame_height - r->y);
+}
+
+static bool capture_region_contains(const struct capture_region *a, const struct capture_region *b)
 {
-    const char sockname[] = "/com/obsproject/vkcapture";
+    return b->x >= a->x && b->y >= a->y
+        && b->x + b->width <= a->x + a->width
+        && b->y + b->height <= a->y + a->height;
+}
+
+static bool capture_consumer_modifier(const struct capture_consumer *c, uint32_t format, uint64_t modifier)
+{
+    if (!c->has_modifiers || modifier == DRM_FORMAT_MOD_INVALID) {
+        return true;
+    }
+    for (int i = 0; i < c->nmodifiers; ++i) {
+        if (c->modifiers[i].format == format && c->modifiers[i].modifier == modifier) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void capture_send_client_data(struct capture_consumer *c)
+{
+    struct capture_client_data cd = {0};
+    cd.type = CAPTURE_CLIENT_DATA_TYPE;
+    get_exe(cd.exe, sizeof(cd.exe));
+    memcpy(cd.device_uuid, data.device_uuid, 16);
+    memcpy(cd.driver_uuid, data.driver_uuid, 16);
+    cd.flags = CAPTURE_CLIENT_MODIFIERS | CAPTURE_CLIENT_RELEASE;
+
+    struct msghdr msg = {0};
+    struct iovec io = {
+        .iov_base = &cd,
+        .iov_len = CAPTURE_CLIENT_DATA_SIZE,
+    };
+    msg.msg_iov = &io;
+    msg.msg_iovlen = 1;
+
+    const ssize_t sent = sendmsg(c->connfd, &msg, MSG_NOSIGNAL);
+    if (sent < 0) {
+        hlog("Socket sendmsg error %s", strerror(errno));
+    }
+}
+
+static bool capture_try_connect(struct capture_consumer *c, int index)
+{
+    char sockname[sizeof(((struct sockaddr_un*)0)->sun_path) - 1];
+    const int len = capture_socket_name(sockname, sizeof(sockname), index);
+    if (len <= 0 || len >= (int)sizeof(sockname)) {
+        return false;
+    }
 
     struct sockaddr_un addr;
     addr.sun_family = PF_LOCAL;
     addr.sun_path[0] = '\0'; // Abstract socket
-    memcpy(&addr.sun_path[1], sockname, sizeof(sockname) - 1);
+    memcpy(&addr.sun_path[1], sockname, len);
 
     int sock = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
-    int ret = connect(sock, (const struct sockaddr *)&addr, sizeof(addr.sun_family) + sizeof(sockname));
+    int ret = connect(sock, (const struct sockaddr *)&addr, sizeof(addr.sun_family) + 1 + len);
     if (ret == -1) {
         close(sock);
         return false;
     }
 
-    data.connfd = sock;
+    c->connfd = sock;
+    c->has_modifiers = false;
+    c->held = 0;
+    c->nmodifiers = 0;
 
-    struct capture_client_data cd;
-    cd.type = CAPTURE_CLIENT_DATA_TYPE;
-    get_exe(cd.exe, sizeof(cd.exe));
+    capture_send_client_data(c);
+
+    return true;
+}
+
+static void capture_disconnect(struct capture_consumer *c)
+{
+    close(c->connfd);
+    c->connfd = -1;
+    c->accepted = false;
+    c->texture_sent = false;
+    c->frame_dropped = false;
+    c->held = 0;
+}
+
+static void capture_read_control(struct capture_consumer *c)
+{
+    while (true) {
+        struct capture_control_data control;
+        ssize_t n = recv(c->connfd, &control, sizeof(control), 0);
+        if (n == sizeof(control) && control.capturing == CAPTURE_MODIFIER_DATA_TYPE) {
+            const struct capture_modifier_data *md = (const struct capture_modifier_data *)&control;
+            c->has_modifiers = true;
+            for (int i = 0; i < MIN(md->count, CAPTURE_MODIFIER_DATA_MAX); ++i) {
+                if (c->nmodifiers == c->modifiers_size) {
+                    const int size = MAX(c->modifiers_size * 2, 64);
+                    void *modifiers = realloc(c->modifiers, size * sizeof(*c->modifiers));
+                    if (!modifiers) {
+                        hlog("Failed to allocate modifiers, ignoring format %08x modifier %" PRIu64,
+                            md->format, md->modifiers[i]);
+                        continue;
+                    }
+                    c->modifiers = modifiers;
+                    c->modifiers_size = size;
+                }
+                c->modifiers[c->nmodifiers].format = md->format;
+                c->modifiers[c->nmodifiers].modifier = md->modifiers[i];
+                c->nmodifiers++;
+            }
+            continue;
+        }
+        if (n == sizeof(control) && control.capturing == CAPTURE_RELEASE_DATA_TYPE) {
+            c->held = ((const struct capture_release_data *)&control)->held;
+            continue;
+        }
+        if (n == sizeof(control)) {
+            const bool old_no_modifiers = c->no_modifiers;
+            const bool old_linear = c->linear;
+            const bool old_map_host = c->map_host;
+            const struct capture_region old_region = c->region;
+            const int old_ring_size = c->ring_size;
+            const bool old_frames = c->frames;
+            c->accepted = control.capturing != CAPTURE_CONTROL_STOP;
+            c->paused = control.capturing == CAPTURE_CONTROL_PAUSE;
+            c->snapshot = control.capturing == CAPTURE_CONTROL_SNAPSHOT;
+            if (c->snapshot) {
+                c->snapshot_pending = true;
+            }
+            c->no_modifiers = control.no_modifiers == 1;
+            c->linear = control.linear == 1;
+            c->map_host = control.map_host == 1;
+            memcpy(c->device_uuid, control.device_uuid, 16);
+            c->region.x = control.region_x;
+            c->region.y = control.region_y;
+            c->region.width = control.region_width;
+            c->region.height = control.region_height;
+            c->ring_size = MIN(control.ring_size, CAPTURE_MAX_SLOTS);
+            // Older OBS don't read frame data and treat last texture as current
+            c->frames = c->ring_size || (control.flags & CAPTURE_CONTROL_FRAMES);
+            if (data.capturing && (old_no_modifiers != c->no_modifiers
+                || old_linear != c->linear
+                || old_map_host != c->map_host
+                || old_ring_size != c->ring_size
+                || old_frames != c->frames
+                || memcmp(&old_region, &c->region, sizeof(c->region)))) {
+                data.need_reinit = true;
+            }
+            if (!c->accepted) {
+                c->texture_sent = false;
+            }
+            continue;
+        }
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            if (errno != ECONNRESET) {
+                hlog("Socket recv error %s", strerror(errno));
+            }
+        }
+        if (n <= 0) {
+            capture_disconnect(c);
+        }
+        return;
+    }
+}
+
+static void capture_send_texture(struct capture_consumer *c)
+{
+    for (int slot = 0; slot < data.nslots; ++slot) {
+        const int nfd = data.tdata[slot].nfd;
+
+        struct msghdr msg = {0};
+
+        struct iovec io = {
+            .iov_base = &data.tdata[slot],
+            .iov_len = CAPTURE_TEXTURE_DATA_SIZE,
+        };
+        msg.msg_iov = &io;
+        msg.msg_iovlen = 1;
+
+        char cmsg_buf[CMSG_SPACE(sizeof(int) * 4)];
+        msg.msg_control = cmsg_buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfd);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfd);
+        memcpy(CMSG_DATA(cmsg), data.fds[slot], sizeof(int) * nfd);
+
+        const ssize_t sent = sendmsg(c->connfd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            hlog("Socket sendmsg error %s", strerror(errno));
+        }
+    }
+
+    c->texture_sent = true;
+}
+
+static void capture_send_frame(struct capture_consumer *c, int slot, uint64_t timestamp,
+        int fence_fd, const struct capture_region *damage)
+{
+    struct capture_frame_data fd = {0};
+    fd.type = CAPTURE_FRAME_DATA_TYPE;
+    fd.slot = slot;
+    fd.timestamp = timestamp;
+    // Damage of a dropped message is lost, so send whole texture once
+    if (damage && !c->frame_dropped) {
+        fd.has_damage = 1;
+        fd.damage_x = damage->x;
+        fd.damage_y = damage->y;
+        fd.damage_width = damage->width;
+        fd.damage_height = damage->height;
+    }
 
     struct msghdr msg = {0};
     struct iovec io = {
-        .iov_base = &cd,
-        .iov_len = CAPTURE_CLIENT_DATA_SIZE,
+        .iov_base = &fd,
+        .iov_len = CAPTURE_FRAME_DATA_SIZE,
     };
     msg.msg_iov = &io;
     msg.msg_iovlen = 1;
 
-    const ssize_t sent = sendmsg(data.connfd, &msg, MSG_NOSIGNAL);
-    if (sent < 0) {
-        hlog("Socket sendmsg error %s", strerror(errno));
+    char cmsg_buf[CMSG_SPACE(sizeof(int))];
+    if (fence_fd >= 0) {
+        msg.msg_control = cmsg_buf;
+        msg.msg_controllen = sizeof(cmsg_buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fence_fd, sizeof(int));
     }
 
-    return true;
+    // Drop the message if OBS is not keeping up, next frame has newer one
+    const ssize_t sent = sendmsg(c->connfd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    c->frame_dropped = sent < 0;
+    if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        hlog("Socket send error %s", strerror(errno));
+    }
 }
 
 void capture_init()
 {
     memset(&data, 0, sizeof(data));
-    data.connfd = -1;
+    for (int i = 0; i < CAPTURE_MAX_CONSUMERS; ++i) {
+        data.consumers[i].connfd = -1;
+    }
 }
 
 void capture_update_socket()
 {
+    // Connected sockets are read every frame so pause/resume is immediate
     static int64_t last_check = 0;
     const int64_t now = os_time_get_nano();
-    if (now - last_check < 1000000000) {
-        return;
+    const bool try_connect = now - last_check >= 1000000000;
+    if (try_connect) {
+        last_check = now;
+    }
+
+    for (int i = 0; i < CAPTURE_MAX_CONSUMERS; ++i) {
+        struct capture_consumer *c = &data.consumers[i];
+        if (c->connfd < 0 && (!try_connect || !capture_try_connect(c, i))) {
+            continue;
+        }
+        capture_read_control(c);
     }
-    last_check = now;
 
-    if (data.connfd < 0 && !capture_try_connect()) {
+    if (!data.capturing || data.need_reinit) {
         return;
     }
 
-    struct capture_control_data control;
-    ssize_t n = recv(data.connfd, &control, sizeof(control), 0);
-    if (n == sizeof(control)) {
-        const bool old_no_modifiers = data.no_modifiers;
-        const bool old_linear = data.linear;
-        const bool old_map_host = data.map_host;
-        data.accepted = control.capturing == 1;
-        data.no_modifiers = control.no_modifiers == 1;
-        data.linear = control.linear == 1;
-        data.map_host = control.map_host == 1;
-        memcpy(data.device_uuid, control.device_uuid, 16);
-        if (data.capturing && (old_no_modifiers != data.no_modifiers
-            || old_linear != data.linear
-            || old_map_host != data.map_host)) {
-            data.need_reinit = true;
+    // Consumers that joined after capture started share the same image
+    for (int i = 0; i < CAPTURE_MAX_CONSUMERS; ++i) {
+        struct capture_consumer *c = &data.consumers[i];
+        if (c->connfd < 0 || !c->accepted || c->texture_sent) {
+            continue;
         }
-    }
-    if (n == -1) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if ((c->no_modifiers && !data.no_modifiers)
+            || (c->linear && !data.linear)
+            || (c->map_host && !data.map_host)) {
+            data.need_reinit = true;
             return;
         }
-        if (errno != ECONNRESET) {
-            hlog("Socket recv error %s", strerror(errno));
+        struct capture_region region;
+        capture_consumer_region(c, &region);
+        if (!capture_region_contains(&data.region, &region)
+            || !capture_consumer_modifier(c, data.tdata[0].format, data.tdata[0].modifier)) {
+            data.need_reinit = true;
+            return;
         }
+        capture_send_texture(c);
     }
-    if (n <= 0) {
-        close(data.connfd);
-        data.connfd = -1;
-        data.accepted = false;
+}
+
+void capture_set_device(const uint8_t device_uuid[16], const uint8_t driver_uuid[16])
+{
+    if (!memcmp(data.device_uuid, device_uuid, 16) && !memcmp(data.driver_uuid, driver_uuid, 16)) {
+        return;
+    }
+    memcpy(data.device_uuid, device_uuid, 16);
+    memcpy(data.driver_uuid, driver_uuid, 16);
+
+    // OBS keys its import strategy cache by device
+    for (int i = 0; i < CAPTURE_MAX_CONSUMERS; ++i) {
+        struct capture_consumer *c = &data.consumers[i];
+        if (c->connfd >= 0) {
+            capture_send_client_data(c);
+        }
     }
 }
 
@@ -165,59 +435,123 @@ void capture_init_shtex(
         int offsets[4], uint64_t modifier, uint32_t winid,
         bool flip, uint32_t color_space, int nfd, int fds[4])
 {
-    struct capture_texture_data td = {0};
-    td.type = CAPTURE_TEXTURE_DATA_TYPE;
-    td.nfd = nfd;
-    td.width = width;
-    td.height = height;
-    td.format = format;
-    memcpy(td.strides, strides, sizeof(int) * nfd);
-    memcpy(td.offsets, offsets, sizeof(int) * nfd);
-    td.modifier = modifier;
-    td.winid = winid;
-    td.flip = flip;
-    td.color_space = color_space;
-
-    struct msghdr msg = {0};
-
-    struct iovec io = {
-        .iov_base = &td,
-        .iov_len = CAPTURE_TEXTURE_DATA_SIZE,
-    };
-    msg.msg_iov = &io;
-    msg.msg_iovlen = 1;
+    struct capture_buffer buffer;
+    buffer.nfd = nfd;
+    memcpy(buffer.fds, fds, sizeof(int) * nfd);
+    memcpy(buffer.strides, strides, sizeof(int) * nfd);
+    memcpy(buffer.offsets, offsets, sizeof(int) * nfd);
+    buffer.modifier = modifier;
+
+    capture_init_shtex_ring(width, height, format, winid, flip, color_space, 1, &buffer);
+}
 
-    char cmsg_buf[CMSG_SPACE(sizeof(int) * 4)];
-    msg.msg_control = cmsg_buf;
-    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfd);
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-    cmsg->cmsg_level = SOL_SOCKET;
-    cmsg->cmsg_type = SCM_RIGHTS;
-    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfd);
-    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfd);
+static void capture_init_textures(
+        int width, int height, int format, uint32_t winid,
+        bool flip, uint32_t color_space, int nslots,
+        const struct capture_buffer *buffers, bool host_memory)
+{
+    data.nslots = nslots;
+    for (int slot = 0; slot < nslots; ++slot) {
+        const struct capture_buffer *b = &buffers[slot];
+        struct capture_texture_data *td = &data.tdata[slot];
+        memset(td, 0, sizeof(*td));
+        td->type = CAPTURE_TEXTURE_DATA_TYPE;
+        td->nfd = b->nfd;
+        td->width = width;
+        td->height = height;
+        td->format = format;
+        memcpy(td->strides, b->strides, sizeof(int) * b->nfd);
+        memcpy(td->offsets, b->offsets, sizeof(int) * b->nfd);
+        td->modifier = b->modifier;
+        td->winid = winid;
+        td->flip = flip;
+        td->color_space = color_space;
+        td->crop_x = data.region.x;
+        td->crop_y = data.region.y;
+        td->slot = slot;
+        td->nslots = nslots;
+        td->host_memory = host_memory;
+        memcpy(data.fds[slot], b->fds, sizeof(int) * b->nfd);
+    }
 
-    const ssize_t sent = sendmsg(data.connfd, &msg, MSG_NOSIGNAL);
-    if (sent < 0) {
-        hlog("Socket sendmsg error %s", strerror(errno));
+    data.no_modifiers = capture_allocate_no_modifiers();
+    data.linear = capture_allocate_linear();
+    data.map_host = capture_allocate_map_host();
+
+    for (int i = 0; i < CAPTURE_MAX_CONSUMERS; ++i) {
+        struct capture_consumer *c = &data.consumers[i];
+        c->texture_sent = false;
+        if (c->connfd >= 0 && c->accepted) {
+            // New image needs a frame even if snapshot was already taken
+            c->snapshot_pending = c->snapshot;
+            capture_send_texture(c);
+        }
     }
 
     data.capturing = true;
     data.need_reinit = false;
 }
 
+void capture_init_shtex_ring(
+        int width, int height, int format, uint32_t winid,
+        bool flip, uint32_t color_space, int nslots,
+        const struct capture_buffer *buffers)
+{
+    capture_init_textures(width, height, format, winid, flip, color_space, nslots, buffers, false);
+}
+
+void capture_init_shtex_memfd(
+        int width, int height, int format, int stride, uint32_t winid,
+        bool flip, uint32_t color_space, int nslots, const int *fds)
+{
+    struct capture_buffer buffers[CAPTURE_MAX_SLOTS] = {0};
+    for (int slot = 0; slot < nslots; ++slot) {
+        buffers[slot].nfd = 1;
+        buffers[slot].fds[0] = fds[slot];
+        buffers[slot].strides[0] = stride;
+        buffers[slot].modifier = DRM_FORMAT_MOD_LINEAR;
+    }
+
+    capture_init_textures(width, height, format, winid, flip, color_space, nslots, buffers, true);
+}
+
 void capture_stop()
 {
     data.capturing = false;
+    for (int i = 0; i < CAPTURE_MAX_CONSUMERS; ++i) {
+        data.consumers[i].texture_sent = false;
+    }
+}
+
+static bool capture_any_accepted()
+{
+    for (int i = 0; i < CAPTURE_MAX_CONSUMERS; ++i) {
+        const struct capture_consumer *c = &data.consumers[i];
+        if (c->connfd >= 0 && c->accepted) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool capture_connected()
+{
+    for (int i = 0; i < CAPTURE_MAX_CONSUMERS; ++i) {
+        if (data.consumers[i].connfd >= 0) {
+            return true;
+        }
+    }
+    return false;
 }
 
 bool capture_should_stop()
 {
-    return data.capturing && (data.connfd < 0 || !data.accepted || data.need_reinit);
+    return data.capturing && (!capture_any_accepted() || data.need_reinit);
 }
 
 bool capture_should_init()
 {
-    return !data.capturing && data.connfd >= 0 && data.accepted;
+    return !data.capturing && capture_any_accepted();
 }
 
 bool capture_ready()
@@ -225,22 +559,163 @@ bool capture_ready()
     return data.capturing;
 }
 
+bool capture_should_copy()
+{
+    for (int i = 0; i < CAPTURE_MAX_CONSUMERS; ++i) {
+        const struct capture_consumer *c = &data.consumers[i];
+        if (c->connfd >= 0 && c->accepted && !c->paused && (!c->snapshot || c->snapshot_pending)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void capture_frame_copied(int slot, int fence_fd, const struct capture_region *damage)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    const uint64_t timestamp = ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+
+    for (int i = 0; i < CAPTURE_MAX_CONSUMERS; ++i) {
+        struct capture_consumer *c = &data.consumers[i];
+        c->snapshot_pending = false;
+        // Sent on every copy, OBS also counts frames and their age
+        if (c->connfd >= 0 && c->texture_sent && c->frames) {
+            capture_send_frame(c, slot, timestamp, fence_fd, damage);
+        }
+    }
+}
+
+int capture_next_slot(int slot, int nslots)
+{
+    uint8_t held = 0;
+    for (int i = 0; i < CAPTURE_MAX_CONSUMERS; ++i) {
+        const struct capture_consumer *c = &data.consumers[i];
+        if (c->connfd >= 0 && c->accepted) {
+            held |= c->held;
+        }
+    }
+    for (int i = 1; i <= nslots; ++i) {
+        const int next = (slot + i) % nslots;
+        if (!(held & (1 << next))) {
+            return next;
+        }
+    }
+    // Every slot is held, overwrite in order
+    return (slot + 1) % nslots;
+}
+
+#define CAPTURE_ANY_CONSUMER(field) \
+    for (int i = 0; i < CAPTURE_MAX_CONSUMERS; ++i) { \
+        const struct capture_consumer *c = &data.consumers[i]; \
+        if (c->connfd >= 0 && c->accepted && c->field) { \
+            return true; \
+        } \
+    } \
+    return false; \
+
 bool capture_allocate_no_modifiers()
 {
-    return data.no_modifiers;
+    CAPTURE_ANY_CONSUMER(no_modifiers)
 }
 
 bool capture_allocate_linear()
 {
-    return data.linear;
+    CAPTURE_ANY_CONSUMER(linear)
 }
 
 bool capture_allocate_map_host()
 {
-    return data.map_host;
+    CAPTURE_ANY_CONSUMER(map_host)
+}
+
+#undef CAPTURE_ANY_CONSUMER
+
+int capture_allocate_ring_size()
+{
+    // Host mapped import only supports single buffer
+    if (capture_allocate_map_host()) {
+        return 1;
+    }
+    int ring_size = 1;
+    for (int i = 0; i < CAPTURE_MAX_CONSUMERS; ++i) {
+        const struct capture_consumer *c = &data.consumers[i];
+        if (c->connfd >= 0 && c->accepted) {
+            ring_size = MAX(ring_size, c->ring_size);
+        }
+    }
+    return ring_size;
+}
+
+bool capture_allocate_frames()
+{
+    bool frames = false;
+    for (int i = 0; i < CAPTURE_MAX_CONSUMERS; ++i) {
+        const struct capture_consumer *c = &data.consumers[i];
+        if (c->connfd >= 0 && c->accepted) {
+            if (!c->frames) {
+                return false;
+            }
+            frames = true;
+        }
+    }
+    return frames;
+}
+
+bool capture_allocate_modifier(uint32_t format, uint64_t modifier)
+{
+    for (int i = 0; i < CAPTURE_MAX_CONSUMERS; ++i) {
+        const struct capture_consumer *c = &data.consumers[i];
+        if (c->connfd >= 0 && c->accepted && !capture_consumer_modifier(c, format, modifier)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void capture_allocate_region(int frame_width, int frame_height, struct capture_region *region)
+{
+    data.frame_width = frame_width;
+    data.frame_height = frame_height;
+
+    int x0 = frame_width;
+    int y0 = frame_height;
+    int x1 = 0;
+    int y1 = 0;
+    for (int i = 0; i < CAPTURE_MAX_CONSUMERS; ++i) {
+        const struct capture_consumer *c = &data.consumers[i];
+        if (c->connfd < 0 || !c->accepted) {
+            continue;
+        }
+        struct capture_region r;
+        capture_consumer_region(c, &r);
+        x0 = MIN(x0, r.x);
+        y0 = MIN(y0, r.y);
+        x1 = MAX(x1, r.x + r.width);
+        y1 = MAX(y1, r.y + r.height);
+    }
+
+    if (x1 <= x0 || y1 <= y0) {
+        x0 = 0;
+        y0 = 0;
+        x1 = frame_width;
+        y1 = frame_height;
+    }
+
+    data.region.x = x0;
+    data.region.y = y0;
+    data.region.width = x1 - x0;
+    data.region.height = y1 - y0;
+    *region = data.region;
 }
 
 bool capture_compare_device_uuid(uint8_t uuid[16])
 {
-    return memcmp(data.device_uuid, uuid, 16) == 0;
+    for (int i = 0; i < CAPTURE_MAX_CONSUMERS; ++i) {
+        const struct capture_consumer *c = &data.consumers[i];
+        if (c->connfd >= 0 && c->accepted && memcmp(c->device_uuid, uuid, 16) != 0) {
+            return false;
+        }
+    }
+    return true;
 }
@@ -18,7 +18,9 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 
 #pragma once
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <assert.h>
 
@@ -47,12 +49,36 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #define AMD_FMT_MOD_GET(field, value) (((value) >> AMD_FMT_MOD_##field##_SHIFT) & AMD_FMT_MOD_##field##_MASK)
 #endif
 
+#define CAPTURE_SOCKET_NAME "/com/obsproject/vkcapture"
+#define CAPTURE_MAX_CONSUMERS 4
+#define CAPTURE_MAX_SLOTS 4
+
+/* Socket name can be overriden with OBS_VKCAPTURE_SOCKET, additional
+ * consumers are bound to "<name>-<index>" */
+static inline int capture_socket_name(char *buf, size_t size, int index)
+{
+    const char *name = getenv("OBS_VKCAPTURE_SOCKET");
+    if (!name || !*name) {
+        name = CAPTURE_SOCKET_NAME;
+    }
+    if (index == 0) {
+        return snprintf(buf, size, "%s", name);
+    }
+    return snprintf(buf, size, "%s-%d", name, index);
+}
+
 struct capture_client_data {
     uint8_t type;
     char exe[48];
-    uint8_t padding[79];
+    uint8_t device_uuid[16];
+    uint8_t driver_uuid[16];
+    uint8_t flags;
+    uint8_t padding[46];
 } __attribute__((packed));
 
+#define CAPTURE_CLIENT_MODIFIERS (1 << 0) // Reads modifier data before control data
+#define CAPTURE_CLIENT_RELEASE (1 << 1) // Reads release data
+
 #define CAPTURE_CLIENT_DATA_TYPE 10
 #define CAPTURE_CLIENT_DATA_SIZE 128
 static_assert(sizeof(struct capture_client_data) == CAPTURE_CLIENT_DATA_SIZE, "size mismatch");
@@ -69,7 +95,12 @@ struct capture_texture_data {
     uint32_t winid;
     uint8_t flip;
     uint32_t color_space;
-    uint8_t padding[65];
+    int32_t crop_x;
+    int32_t crop_y;
+    uint8_t slot;
+    uint8_t nslots;
+    uint8_t host_memory; // memfd with frames read back by the client
+    uint8_t padding[54];
 } __attribute__((packed));
 
 #define CAPTURE_TEXTURE_DATA_TYPE 11
@@ -82,27 +113,114 @@ struct capture_control_data {
     uint8_t linear;
     uint8_t map_host;
     uint8_t device_uuid[16];
-    uint8_t padding[12];
+    uint16_t region_x;
+    uint16_t region_y;
+    uint16_t region_width; // 0 = whole frame
+    uint16_t region_height;
+    uint8_t ring_size;
+    uint8_t flags;
+    uint8_t padding[2];
 } __attribute__((packed));
 
+#define CAPTURE_CONTROL_FRAMES (1 << 0) // Reads frame data, implied by ring_size
+
+/* Frame data may carry a sync_file fd signaled when the copy into the slot
+ * finished, OBS must wait for it before sampling */
+struct capture_frame_data {
+    uint8_t type;
+    uint8_t slot;
+    uint64_t timestamp; // CLOCK_MONOTONIC ns of present
+    uint8_t has_damage; // 0 = whole texture changed
+    uint16_t damage_x; // Texture rect changed since previous frame
+    uint16_t damage_y;
+    uint16_t damage_width;
+    uint16_t damage_height;
+    uint8_t padding[109];
+} __attribute__((packed));
+
+#define CAPTURE_FRAME_DATA_TYPE 12
+#define CAPTURE_FRAME_DATA_SIZE 128
+static_assert(sizeof(struct capture_frame_data) == CAPTURE_FRAME_DATA_SIZE, "size mismatch");
+
+#define CAPTURE_CONTROL_STOP 0
+#define CAPTURE_CONTROL_CAPTURE 1
+#define CAPTURE_CONTROL_SNAPSHOT 2 // Copy next frame only
+#define CAPTURE_CONTROL_PAUSE 3 // Keep texture, but don't copy frames
+
 #define CAPTURE_CONTROL_DATA_TYPE 10
 #define CAPTURE_CONTROL_DATA_SIZE 32
 static_assert(sizeof(struct capture_control_data) == CAPTURE_CONTROL_DATA_SIZE, "size mismatch");
 
+/* Modifiers OBS can import, sent before the first control data. Type
+ * shares the first byte with capturing of control data. */
+struct capture_modifier_data {
+    uint8_t type;
+    uint8_t count;
+    uint8_t padding[2];
+    uint32_t format;
+    uint64_t modifiers[3];
+} __attribute__((packed));
+
+#define CAPTURE_MODIFIER_DATA_TYPE 0x80
+#define CAPTURE_MODIFIER_DATA_MAX 3
+static_assert(sizeof(struct capture_modifier_data) == CAPTURE_CONTROL_DATA_SIZE, "size mismatch");
+
+/* Ring slots OBS may still sample, sent whenever they change. Client
+ * doesn't write them while another slot is free. */
+struct capture_release_data {
+    uint8_t type;
+    uint8_t held; // Bit per slot
+    uint8_t padding[30];
+} __attribute__((packed));
+
+#define CAPTURE_RELEASE_DATA_TYPE 0x81
+static_assert(sizeof(struct capture_release_data) == CAPTURE_CONTROL_DATA_SIZE, "size mismatch");
+
+struct capture_region {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+struct capture_buffer {
+    int nfd;
+    int fds[4];
+    int strides[4];
+    int offsets[4];
+    uint64_t modifier;
+};
+
 void capture_init();
 void capture_update_socket();
+void capture_set_device(const uint8_t device_uuid[16], const uint8_t driver_uuid[16]);
 void capture_init_shtex(
         int width, int height, int format, int strides[4],
         int offsets[4], uint64_t modifier, uint32_t winid,
         bool flip, uint32_t color_space, int nfd, int fds[4]);
+void capture_init_shtex_ring(
+        int width, int height, int format, uint32_t winid,
+        bool flip, uint32_t color_space, int nslots,
+        const struct capture_buffer *buffers);
+void capture_init_shtex_memfd(
+        int width, int height, int format, int stride, uint32_t winid,
+        bool flip, uint32_t color_space, int nslots, const int *fds);
 void capture_stop();
 
+bool capture_connected();
 bool capture_should_stop();
 bool capture_should_init();
 bool capture_ready();
+bool capture_should_copy();
+void capture_frame_copied(int slot, int fence_fd, const struct capture_region *damage);
+int capture_next_slot(int slot, int nslots);
 
 bool capture_allocate_no_modifiers();
 bool capture_allocate_linear();
 bool capture_allocate_map_host();
+int capture_allocate_ring_size();
+bool capture_allocate_frames();
+bool capture_allocate_modifier(uint32_t format, uint64_t modifier);
+void capture_allocate_region(int frame_width, int frame_height, struct capture_region *region);
 
 bool capture_compare_device_uuid(uint8_t uuid[16]);
@@ -0,0 +1,122 @@
+/*
+OBS Linux Vulkan/OpenGL game capture
+Copyright (C) 2021 David Rosca <nowrep@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "cursor-cache.h"
+
+#define CURSOR_CACHE_SIZE 8
+
+struct cursor_cache_entry {
+    uint32_t serial;
+    uint64_t hash;
+    uint32_t width;
+    uint32_t height;
+    gs_texture_t *tex;
+    uint64_t last_used;
+};
+
+struct cursor_cache {
+    DARRAY(struct cursor_cache_entry) entries;
+    uint64_t use_count;
+};
+
+cursor_cache_t *cursor_cache_create(void)
+{
+    cursor_cache_t *cache = bzalloc(sizeof(cursor_cache_t));
+    da_init(cache->entries);
+    return cache;
+}
+
+void cursor_cache_destroy(cursor_cache_t *cache)
+{
+    for (size_t i = 0; i < cache->entries.num; ++i) {
+        gs_texture_destroy(cache->entries.array[i].tex);
+    }
+    da_free(cache->entries);
+    bfree(cache);
+}
+
+uint64_t cursor_cache_hash(const uint8_t *pixels, uint32_t width,
+        uint32_t height, uint32_t stride)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (uint32_t y = 0; y < height; ++y) {
+        const uint8_t *row = pixels + y * stride;
+        for (uint32_t x = 0; x < width * 4; ++x) {
+            hash = (hash ^ row[x]) * 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+gs_texture_t *cursor_cache_get(cursor_cache_t *cache, uint32_t serial,
+        uint64_t hash, const uint8_t *pixels, uint32_t width,
+        uint32_t height, uint32_t stride)
+{
+    struct cursor_cache_entry *entry = NULL;
+
+    for (size_t i = 0; i < cache->entries.num && serial; ++i) {
+        struct cursor_cache_entry *e = &cache->entries.array[i];
+        if (e->serial == serial && e->width == width && e->height == height) {
+            entry = e;
+            break;
+        }
+    }
+
+    // Same image may come back with a new serial
+    for (size_t i = 0; i < cache->entries.num && !entry; ++i) {
+        struct cursor_cache_entry *e = &cache->entries.array[i];
+        if (e->hash == hash && e->width == width && e->height == height) {
+            entry = e;
+            entry->serial = serial;
+            break;
+        }
+    }
+
+    if (!entry) {
+        if (cache->entries.num < CURSOR_CACHE_SIZE) {
+            entry = da_push_back_new(cache->entries);
+        } else {
+            entry = &cache->entries.array[0];
+            for (size_t i = 1; i < cache->entries.num; ++i) {
+                if (cache->entries.array[i].last_used < entry->last_used) {
+                    entry = &cache->entries.array[i];
+                }
+            }
+        }
+
+        if (entry->tex && entry->width == width && entry->height == height) {
+            gs_texture_set_image(entry->tex, pixels, stride, false);
+        } else {
+            if (entry->tex) {
+                gs_texture_destroy(entry->tex);
+            }
+            entry->tex = gs_texture_create(width, height, GS_BGRA, 1, NULL, GS_DYNAMIC);
+            if (entry->tex) {
+                gs_texture_set_image(entry->tex, pixels, stride, false);
+            }
+        }
+        entry->serial = serial;
+        entry->hash = hash;
+        entry->width = width;
+        entry->height = height;
+    }
+
+    entry->last_used = ++cache->use_count;
+    return entry->tex;
+}
@@ -0,0 +1,40 @@
+/*
+OBS Linux Vulkan/OpenGL game capture
+Copyright (C) 2021 David Rosca <nowrep@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include <obs.h>
+
+/* Recently used cursor textures, so switching between cursor shapes
+ * doesn't need a texture upload. Used by both XCB and Wayland cursor. */
+typedef struct cursor_cache cursor_cache_t;
+
+cursor_cache_t *cursor_cache_create(void);
+
+/* Needs graphics context */
+void cursor_cache_destroy(cursor_cache_t *cache);
+
+uint64_t cursor_cache_hash(const uint8_t *pixels, uint32_t width,
+        uint32_t height, uint32_t stride);
+
+/* Returns texture with the cursor image, which stays valid until the next
+ * call. Serial 0 means unknown, then only the hash is compared.
+ * Needs graphics context. */
+gs_texture_t *cursor_cache_get(cursor_cache_t *cache, uint32_t serial,
+        uint64_t hash, const uint8_t *pixels, uint32_t width,
+        uint32_t height, uint32_t stride);
@@ -80,8 +80,7 @@ void *real_dlvsym(void *handle, const char *symbol, const char *version)
     return dl_f.dlvsym(handle, symbol, version);
 }
 
-extern void *obs_vkcapture_glXGetProcAddress(const char *name);
-extern void *obs_vkcapture_eglGetProcAddress(const char *name);
+extern void *obs_vkcapture_dlsym(const char *name);
 
 void *dlsym(void *handle, const char *symbol)
 {
@@ -89,10 +88,7 @@ void *dlsym(void *handle, const char *symbol)
     if (!real_func) {
         return NULL;
     }
-    void *func = obs_vkcapture_glXGetProcAddress(symbol);
-    if (!func) {
-        func = obs_vkcapture_eglGetProcAddress(symbol);
-    }
+    void *func = obs_vkcapture_dlsym(symbol);
     return func ? func : real_func;
 }
 
@@ -102,9 +98,6 @@ void *dlvsym(void *handle, const char *symbol, const char *version)
     if (!real_func) {
         return NULL;
     }
-    void *func = obs_vkcapture_glXGetProcAddress(symbol);
-    if (!func) {
-        func = obs_vkcapture_eglGetProcAddress(symbol);
-    }
+    void *func = obs_vkcapture_dlsym(symbol);
     return func ? func : real_func;
 }
@@ -27,8 +27,11 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include "vklayer.h"
 
 #include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <stdlib.h>
 #include <inttypes.h>
 
@@ -41,39 +44,72 @@ static struct x11_funcs x11_f;
 static struct vk_funcs vk_f;
 
 static bool vkcapture_glvulkan = false;
+static bool vkcapture_prewarm = false;
+
+// Blit target, slots are written round-robin so OBS never samples the one being copied to
+struct gl_slot {
+    GLuint texture;
+    void *image;
+    unsigned long xpixmap;
+    void *glxpixmap;
+    VkImage vkimage;
+    VkDeviceMemory vkmemory;
+    struct capture_buffer buf;
+    struct capture_region damage; // Changed since the slot was last written
+};
+
+#define GL_CAPTURE_SLOTS 3
+#define GL_READBACK_SLOTS 3
+#define GL_READBACK_BUFFERS 3 // OBS skips the one written next
 
 struct gl_data {
     void *display;
     void *surface;
+    void *context;
     int width;
     int height;
     GLuint fbo;
-    GLuint texture;
-    void *image;
     int buf_fourcc;
-    int buf_strides[4];
-    int buf_offsets[4];
-    uint64_t buf_modifier;
     uint32_t winid;
-    int nfd;
-    int buf_fds[4];
+    int nslots;
+    int slot;
+    struct gl_slot slots[CAPTURE_MAX_SLOTS];
+    struct capture_region damage; // Changed since the last frame sent to OBS
+    bool native_fence;
+
+    // Readback tier when no dmabuf can be exported. Frames are read into a
+    // ring of PBOs and copied three captures later into one of the memfds
+    // shared with OBS, alternating so OBS can upload one while the other is written.
+    GLuint pbos[GL_READBACK_SLOTS];
+    GLsync pbo_fences[GL_READBACK_SLOTS];
+    int pbo_index;
+    bool readback_stale;
+    GLenum readback_format;
+    void *readback_maps[GL_READBACK_BUFFERS];
+    size_t readback_size;
 
     bool glx;
-    unsigned long xpixmap;
-    void *glxpixmap;
 
     VkInstance vkinst;
     VkPhysicalDevice vkphys_dev;
     VkDevice vkdev;
-    VkImage vkimage;
-    VkDeviceMemory vkmemory;
 
     uint8_t device_uuid[16];
+    bool device_queried;
+
+    struct capture_region region;
 
     bool valid;
 };
 static struct gl_data data;
 
+/* Framebuffer bindings and sRGB enable the capture changes */
+struct gl_state {
+    GLint read_fbo;
+    GLint draw_fbo;
+    GLboolean srgb;
+};
+
 #define GETADDR(s, p, func) \
     p.func = (typeof(p.func))real_dlsym(RTLD_NEXT, #s #func); \
     if (!p.func && handle) { \
@@ -125,10 +161,13 @@ static bool gl_init_funcs(bool glx)
     x11_f.valid = false;
 
     vkcapture_glvulkan = getenv("OBS_VKCAPTURE_GLVULKAN");
+    vkcapture_prewarm = getenv("OBS_VKCAPTURE");
 
     capture_init();
     memset(&data, 0, sizeof(struct gl_data));
-    memset(data.buf_fds, -1, sizeof(data.buf_fds));
+    for (int i = 0; i < CAPTURE_MAX_SLOTS; ++i) {
+        memset(data.slots[i].buf.fds, -1, sizeof(data.slots[i].buf.fds));
+    }
     data.glx = glx;
 
     if (glx) {
@@ -140,6 +179,7 @@ static bool gl_init_funcs(bool glx)
         GETGLXADDR(GetProcAddress);
         GETGLXADDR(GetProcAddressARB);
         GETGLXPROCADDR(DestroyContext);
+        GETGLXPROCADDR(GetCurrentContext);
         GETGLXPROCADDR(SwapBuffers);
         GETGLXPROCADDR(SwapBuffersMscOML);
         GETGLXPROCADDR(CreatePixmap);
@@ -187,6 +227,7 @@ static bool gl_init_funcs(bool glx)
         GETEGLADDR(GetProcAddress);
         GETEGLPROCADDR(DestroyContext);
         GETEGLPROCADDR(GetCurrentContext);
+        GETEGLPROCADDR(DestroySurface);
         GETEGLPROCADDR(CreateWindowSurface);
         GETEGLPROCADDR(CreateImage);
         GETEGLPROCADDR(DestroyImage);
@@ -194,6 +235,14 @@ static bool gl_init_funcs(bool glx)
         GETEGLPROCADDR(SwapBuffers);
         GETEGLPROCADDR(ExportDMABUFImageQueryMESA);
         GETEGLPROCADDR(ExportDMABUFImageMESA);
+        GETEGLPROCADDR(QueryString);
+        // Optional, frames are sent without fence when missing
+        egl_f.CreateSyncKHR = (typeof(egl_f.CreateSyncKHR))egl_f.GetProcAddress("eglCreateSyncKHR");
+        egl_f.DestroySyncKHR = (typeof(egl_f.DestroySyncKHR))egl_f.GetProcAddress("eglDestroySyncKHR");
+        egl_f.DupNativeFenceFDANDROID = (typeof(egl_f.DupNativeFenceFDANDROID))egl_f.GetProcAddress("eglDupNativeFenceFDANDROID");
+        // Only hooked when the driver has them
+        egl_f.SwapBuffersWithDamageKHR = (typeof(egl_f.SwapBuffersWithDamageKHR))egl_f.GetProcAddress("eglSwapBuffersWithDamageKHR");
+        egl_f.SwapBuffersWithDamageEXT = (typeof(egl_f.SwapBuffersWithDamageEXT))egl_f.GetProcAddress("eglSwapBuffersWithDamageEXT");
         gl_f.GetProcAddress = egl_f.GetProcAddress;
         egl_f.valid = true;
     }
@@ -214,8 +263,21 @@ static bool gl_init_funcs(bool glx)
     GETGLPROCADDR(ReadBuffer);
     GETGLPROCADDR(DrawBuffer);
     GETGLPROCADDR(BlitFramebuffer);
+    GETGLPROCADDR(Flush);
+    GETGLPROCADDR(GenBuffers);
+    GETGLPROCADDR(DeleteBuffers);
+    GETGLPROCADDR(BindBuffer);
+    GETGLPROCADDR(BufferData);
+    GETGLPROCADDR(MapBufferRange);
+    GETGLPROCADDR(UnmapBuffer);
+    GETGLPROCADDR(ReadPixels);
+    GETGLPROCADDR(PixelStorei);
+    GETGLPROCADDR(FenceSync);
+    GETGLPROCADDR(ClientWaitSync);
+    GETGLPROCADDR(DeleteSync);
     GETGLPROCADDR(GetError);
     GETGLPROCADDR(GetString);
+    GETGLPROCADDR(GetStringi);
     GETGLPROCADDR(GetUnsignedBytei_vEXT);
     GETGLPROCADDR(CreateMemoryObjectsEXT);
     GETGLPROCADDR(MemoryObjectParameterivEXT);
@@ -271,18 +333,13 @@ static bool vulkan_init_funcs()
 #define GETINSTPROC(func) GETVKPROC(GetInstanceProcAddr, vkinst, func)
 #define GETDEVPROC(func) GETVKPROC(GetDeviceProcAddr, vkdev, func)
 
-static bool vulkan_init()
+// Interop device of data.device_uuid, created by prewarm thread or on capture start
+static bool vulkan_create()
 {
-    if (data.vkdev) {
-        return true;
-    }
-
     if (!vulkan_init_funcs()) {
         return false;
     }
 
-    gl_f.GetUnsignedBytei_vEXT(0x9597, 0, data.device_uuid);
-
     const char *instance_extensions[] = {
         VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME,
         VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME,
@@ -305,6 +362,7 @@ static bool vulkan_init()
     VkApplicationInfo appInfo = {};
     appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
     appInfo.pApplicationName = "OBS vkcapture";
+    appInfo.pEngineName = OBS_VKCAPTURE_GL_ENGINE_NAME;
     appInfo.apiVersion = VK_API_VERSION_1_0;
 
     VkInstanceCreateInfo instanceInfo = {};
@@ -313,17 +371,8 @@ static bool vulkan_init()
     instanceInfo.enabledExtensionCount = sizeof(instance_extensions) / sizeof(*instance_extensions);
     instanceInfo.ppEnabledExtensionNames = instance_extensions;
 
-    char *disable_vkcapture = getenv("DISABLE_OBS_VKCAPTURE");
-    setenv("DISABLE_OBS_VKCAPTURE", "1", 1);
-
+    // Layer ignores instances with our engine name
     VkResult res = vk_f.CreateInstance(&instanceInfo, NULL, &data.vkinst);
-
-    if (disable_vkcapture) {
-        setenv("DISABLE_OBS_VKCAPTURE", disable_vkcapture, 1);
-    } else {
-        unsetenv("DISABLE_OBS_VKCAPTURE");
-    }
-
     if (res != VK_SUCCESS) {
         hlog("Vulkan: Failed to create instance %s", result_to_str(res));
         return false;
@@ -409,6 +458,7 @@ fail:
         vk_f.DestroyInstance(data.vkinst, NULL);
         data.vkinst = VK_NULL_HANDLE;
     }
+    data.vkphys_dev = VK_NULL_HANDLE;
     return false;
 }
 
@@ -416,126 +466,74 @@ fail:
 #undef GETINSTPROC
 #undef GETDEVPROC
 
-static bool vulkan_shtex_init()
+static pthread_t vulkan_prewarm_thread;
+static bool vulkan_prewarm_started = false;
+
+static void *vulkan_prewarm_run(void *arg)
 {
-    if (!vulkan_init()) {
-        return false;
+    const int64_t start = os_time_get_nano();
+    if (vulkan_create()) {
+        hlog("Vulkan interop device ready in %" PRId64 " ms", (os_time_get_nano() - start) / 1000000);
     }
+    return NULL;
+}
 
-    gl_f.GenFramebuffers(1, &data.fbo);
-    if (data.fbo == 0) {
-        hlog("Failed to initialize FBO");
-        return false;
+/* Creating instance and device takes long enough to stutter the game,
+ * so it is done off the render thread once OBS connected, but only
+ * where gl_shtex_init is known to be skipped */
+static void vulkan_prewarm()
+{
+    if (!vkcapture_prewarm || vulkan_prewarm_started) {
+        return;
     }
+    if (!vkcapture_glvulkan) {
+        const char *vendor = (const char*)gl_f.GetString(GL_VENDOR);
+        if (!data.glx || !vendor || strcmp(vendor, "NVIDIA Corporation") != 0) {
+            return;
+        }
+    }
+    vulkan_prewarm_started = pthread_create(&vulkan_prewarm_thread, NULL, vulkan_prewarm_run, NULL) == 0;
+    if (vulkan_prewarm_started) {
+        pthread_setname_np(vulkan_prewarm_thread, "glcapture-vk");
+    }
+}
 
-    const bool no_modifiers = capture_allocate_no_modifiers();
-    const bool linear = capture_allocate_linear();
-    const bool map_host = capture_allocate_map_host();
-    const bool same_device = capture_compare_device_uuid(data.device_uuid);
-
-    hlog("Texture %s %ux%u", "GL_RGBA (Vulkan)", data.width, data.height);
-
-    VkExternalMemoryImageCreateInfo ext_mem_image_info = {};
-    ext_mem_image_info.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
-    ext_mem_image_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT | VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT_KHR;
-
-    VkImageCreateInfo img_info = {};
-    img_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    img_info.pNext = &ext_mem_image_info;
-    img_info.imageType = VK_IMAGE_TYPE_2D;
-    img_info.format = VK_FORMAT_B8G8R8A8_UNORM;
-    img_info.mipLevels = 1;
-    img_info.arrayLayers = 1;
-    img_info.samples = VK_SAMPLE_COUNT_1_BIT;
-    img_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    img_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    img_info.extent.width = data.width;
-    img_info.extent.height = data.height;
-    img_info.extent.depth = 1;
-    img_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-    img_info.tiling = VK_IMAGE_TILING_LINEAR;
-
-    int num_planes = 1;
-    uint64_t *image_modifiers = NULL;
-    VkImageDrmFormatModifierListCreateInfoEXT image_modifier_list = {};
-    struct VkDrmFormatModifierPropertiesEXT *modifier_props = NULL;
-    uint32_t modifier_prop_count = 0;
-
-    if (!no_modifiers && vk_f.GetImageDrmFormatModifierPropertiesEXT) {
-        VkDrmFormatModifierPropertiesListEXT modifier_props_list = {};
-        modifier_props_list.sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT;
-
-        VkFormatProperties2KHR format_props = {};
-        format_props.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
-        format_props.pNext = &modifier_props_list;
-
-        vk_f.GetPhysicalDeviceFormatProperties2KHR(data.vkphys_dev, img_info.format, &format_props);
-
-        modifier_props = malloc(modifier_props_list.drmFormatModifierCount * sizeof(struct VkDrmFormatModifierPropertiesEXT));
-        modifier_props_list.pDrmFormatModifierProperties = modifier_props;
-
-        vk_f.GetPhysicalDeviceFormatProperties2KHR(data.vkphys_dev, img_info.format, &format_props);
-
-#ifndef NDEBUG
-        hlog("Available modifiers:");
-#endif
-        for (uint32_t i = 0; i < modifier_props_list.drmFormatModifierCount; i++) {
-            if (linear && modifier_props[i].drmFormatModifier != DRM_FORMAT_MOD_LINEAR) {
-                continue;
-            }
-            VkPhysicalDeviceImageDrmFormatModifierInfoEXT mod_info = {};
-            mod_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT;
-            mod_info.drmFormatModifier = modifier_props[i].drmFormatModifier;
-            mod_info.sharingMode = img_info.sharingMode;
-
-            VkPhysicalDeviceImageFormatInfo2 format_info = {};
-            format_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
-            format_info.pNext = &mod_info;
-            format_info.format = img_info.format;
-            format_info.type = VK_IMAGE_TYPE_2D;
-            format_info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
-            format_info.usage = img_info.usage;
-            format_info.flags = img_info.flags;
-
-            VkImageFormatProperties2KHR format_props = {};
-            format_props.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
+static bool vulkan_init()
+{
+    if (vulkan_prewarm_started) {
+        pthread_join(vulkan_prewarm_thread, NULL);
+        vulkan_prewarm_started = false;
+    }
 
-            VkResult result = vk_f.GetPhysicalDeviceImageFormatProperties2KHR(data.vkphys_dev, &format_info, &format_props);
-            if (result == VK_SUCCESS) {
-#ifndef NDEBUG
-                hlog(" %d: modifier:%"PRIu64" planes:%d", i,
-                        modifier_props[i].drmFormatModifier,
-                        modifier_props[i].drmFormatModifierPlaneCount);
-#endif
-                modifier_props[modifier_prop_count++] = modifier_props[i];
-            }
-        }
+    if (data.vkdev) {
+        return true;
+    }
 
-        if (modifier_prop_count > 0) {
-            image_modifiers = malloc(sizeof(uint64_t) * modifier_prop_count);
-            for (uint32_t i = 0; i < modifier_prop_count; ++i) {
-                image_modifiers[i] = modifier_props[i].drmFormatModifier;
-            }
+    return vulkan_create();
+}
 
-            image_modifier_list.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_LIST_CREATE_INFO_EXT;
-            image_modifier_list.drmFormatModifierCount = modifier_prop_count;
-            image_modifier_list.pDrmFormatModifiers = image_modifiers;
-            img_info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
-            ext_mem_image_info.pNext = &image_modifier_list;
-        } else {
-            hlog("No suitable DRM modifier found!");
-        }
+static int gl_capture_slots()
+{
+    // Host mapped import only supports single buffer, slots are only
+    // told apart with frame data
+    if (capture_allocate_map_host() || !capture_allocate_frames()) {
+        return 1;
     }
+    return MAX(capture_allocate_ring_size(), GL_CAPTURE_SLOTS);
+}
 
-    VkResult res = vk_f.CreateImage(data.vkdev, &img_info, NULL, &data.vkimage);
-    free(image_modifiers);
+static bool vulkan_shtex_init_slot(struct gl_slot *slot, const VkImageCreateInfo *img_info,
+        bool use_modifiers, bool same_device, bool map_host, bool linear,
+        const struct VkDrmFormatModifierPropertiesEXT *modifier_props, uint32_t modifier_prop_count)
+{
+    VkResult res = vk_f.CreateImage(data.vkdev, img_info, NULL, &slot->vkimage);
     if (res != VK_SUCCESS) {
         hlog("Vulkan: Failed to create image %s", result_to_str(res));
         return false;
     }
 
     VkImageMemoryRequirementsInfo2 memri = {};
-    memri.image = data.vkimage;
+    memri.image = slot->vkimage;
     memri.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
 
     VkMemoryDedicatedRequirements mdr = {};
@@ -560,7 +558,7 @@ static bool vulkan_shtex_init()
     VkMemoryDedicatedAllocateInfo memory_dedicated_info = {};
     memory_dedicated_info.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
     memory_dedicated_info.pNext = &memory_export_info;
-    memory_dedicated_info.image = data.vkimage;
+    memory_dedicated_info.image = slot->vkimage;
 
     VkMemoryAllocateInfo memi = {};
     memi.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
@@ -577,7 +575,7 @@ static bool vulkan_shtex_init()
                 (pdmp.memoryTypes[i].propertyFlags &
                  mem_req_bits) == mem_req_bits) {
             memi.memoryTypeIndex = i;
-            res = vk_f.AllocateMemory(data.vkdev, &memi, NULL, &data.vkmemory);
+            res = vk_f.AllocateMemory(data.vkdev, &memi, NULL, &slot->vkmemory);
             allocated = res == VK_SUCCESS;
             if (allocated)
                 break;
@@ -591,7 +589,7 @@ static bool vulkan_shtex_init()
                     (pdmp.memoryTypes[i].propertyFlags &
                      mem_req_bits) != mem_req_bits) {
                 memi.memoryTypeIndex = i;
-                res = vk_f.AllocateMemory(data.vkdev, &memi, NULL, &data.vkmemory);
+                res = vk_f.AllocateMemory(data.vkdev, &memi, NULL, &slot->vkmemory);
                 allocated = res == VK_SUCCESS;
                 if (allocated)
                     break;
@@ -607,8 +605,8 @@ static bool vulkan_shtex_init()
 
     VkBindImageMemoryInfo bimi = {};
     bimi.sType = VK_STRUCTURE_TYPE_BIND_IMAGE_MEMORY_INFO;
-    bimi.image = data.vkimage;
-    bimi.memory = data.vkmemory;
+    bimi.image = slot->vkimage;
+    bimi.memory = slot->vkmemory;
     bimi.memoryOffset = 0;
     res = vk_f.BindImageMemory2KHR(data.vkdev, 1, &bimi);
     if (res != VK_SUCCESS) {
@@ -618,7 +616,7 @@ static bool vulkan_shtex_init()
 
     VkMemoryGetFdInfoKHR memFdInfo = {};
     memFdInfo.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR;
-    memFdInfo.memory = data.vkmemory;
+    memFdInfo.memory = slot->vkmemory;
     memFdInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT_KHR;
     int fd = -1;
     res = vk_f.GetMemoryFdKHR(data.vkdev, &memFdInfo, &fd);
@@ -636,10 +634,10 @@ static bool vulkan_shtex_init()
     gl_f.MemoryObjectParameterivEXT(glmem, GL_DEDICATED_MEMORY_OBJECT_EXT, &dedicated);
     gl_f.ImportMemoryFdEXT(glmem, memi.allocationSize, GL_HANDLE_TYPE_OPAQUE_FD_EXT, fd);
 
-    gl_f.GenTextures(1, &data.texture);
-    gl_f.BindTexture(GL_TEXTURE_2D, data.texture);
-    gl_f.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_TILING_EXT, img_info.tiling == VK_IMAGE_TILING_LINEAR || linear ? GL_LINEAR_TILING_EXT : GL_OPTIMAL_TILING_EXT);
-    gl_f.TexStorageMem2DEXT(GL_TEXTURE_2D, 1, GL_RGBA8, data.width, data.height, glmem, 0);
+    gl_f.GenTextures(1, &slot->texture);
+    gl_f.BindTexture(GL_TEXTURE_2D, slot->texture);
+    gl_f.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_TILING_EXT, img_info->tiling == VK_IMAGE_TILING_LINEAR || linear ? GL_LINEAR_TILING_EXT : GL_OPTIMAL_TILING_EXT);
+    gl_f.TexStorageMem2DEXT(GL_TEXTURE_2D, 1, GL_RGBA8, data.region.width, data.region.height, glmem, 0);
     gl_f.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl_f.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
@@ -656,30 +654,30 @@ static bool vulkan_shtex_init()
         return false;
     }
 
-    if (!no_modifiers && vk_f.GetImageDrmFormatModifierPropertiesEXT) {
+    int num_planes = 1;
+    if (use_modifiers) {
         VkImageDrmFormatModifierPropertiesEXT image_mod_props = {};
         image_mod_props.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_PROPERTIES_EXT;
-        res = vk_f.GetImageDrmFormatModifierPropertiesEXT(data.vkdev, data.vkimage, &image_mod_props);
+        res = vk_f.GetImageDrmFormatModifierPropertiesEXT(data.vkdev, slot->vkimage, &image_mod_props);
         if (VK_SUCCESS != res) {
             hlog("GetImageDrmFormatModifierPropertiesEXT failed %s", result_to_str(res));
-            data.buf_modifier = DRM_FORMAT_MOD_INVALID;
+            slot->buf.modifier = DRM_FORMAT_MOD_INVALID;
         } else {
-            data.buf_modifier = image_mod_props.drmFormatModifier;
+            slot->buf.modifier = image_mod_props.drmFormatModifier;
             for (uint32_t i = 0; i < modifier_prop_count; ++i) {
-                if (modifier_props[i].drmFormatModifier == data.buf_modifier) {
+                if (modifier_props[i].drmFormatModifier == slot->buf.modifier) {
                     num_planes = modifier_props[i].drmFormatModifierPlaneCount;
                     break;
                 }
             }
         }
-        free(modifier_props);
     } else {
-        data.buf_modifier = DRM_FORMAT_MOD_INVALID;
+        slot->buf.modifier = DRM_FORMAT_MOD_INVALID;
     }
 
     for (int i = 0; i < num_planes; i++) {
         VkImageSubresource sbr = {};
-        if (!no_modifiers && vk_f.GetImageDrmFormatModifierPropertiesEXT) {
+        if (use_modifiers) {
             sbr.aspectMask = VK_IMAGE_ASPECT_MEMORY_PLANE_0_BIT_EXT << i;
         } else {
             sbr.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -687,160 +685,578 @@ static bool vulkan_shtex_init()
         sbr.mipLevel = 0;
         sbr.arrayLayer = 0;
         VkSubresourceLayout layout;
-        vk_f.GetImageSubresourceLayout(data.vkdev, data.vkimage, &sbr, &layout);
+        vk_f.GetImageSubresourceLayout(data.vkdev, slot->vkimage, &sbr, &layout);
 
-        data.buf_fds[i] = i == 0 ? dmabuf_fd : os_dupfd_cloexec(dmabuf_fd);
-        data.buf_strides[i] = layout.rowPitch;
-        data.buf_offsets[i] = layout.offset;
+        slot->buf.fds[i] = i == 0 ? dmabuf_fd : os_dupfd_cloexec(dmabuf_fd);
+        slot->buf.strides[i] = layout.rowPitch;
+        slot->buf.offsets[i] = layout.offset;
     }
-    data.nfd = num_planes;
-    data.buf_fourcc = DRM_FORMAT_ABGR8888;
+    slot->buf.nfd = num_planes;
 
 #ifndef NDEBUG
-    hlog("Got planes %d fd %d", data.nfd, data.buf_fds[0]);
-    if (data.buf_modifier != DRM_FORMAT_MOD_INVALID) {
-        hlog("Got modifier %"PRIu64, data.buf_modifier);
+    hlog("Got planes %d fd %d", slot->buf.nfd, slot->buf.fds[0]);
+    if (slot->buf.modifier != DRM_FORMAT_MOD_INVALID) {
+        hlog("Got modifier %"PRIu64, slot->buf.modifier);
     }
 #endif
 
     return true;
 }
 
-static void querySurface(int *width, int *height)
+static bool vulkan_shtex_init()
 {
-    if (data.glx) {
-        unsigned w, h;
-        glx_f.QueryDrawable(data.display, data.surface, P_GLX_WIDTH, &w);
-        glx_f.QueryDrawable(data.display, data.surface, P_GLX_HEIGHT, &h);
-        *width = w;
-        *height = h;
-    } else {
-        egl_f.QuerySurface(data.display, data.surface, P_EGL_WIDTH, width);
-        egl_f.QuerySurface(data.display, data.surface, P_EGL_HEIGHT, height);
+    if (!vulkan_init()) {
+        return false;
     }
-}
-
-static void gl_free()
-{
-    const bool was_capturing = data.nfd;
 
-    if (data.nfd) {
-        for (int i = 0; i < data.nfd; ++i) {
-            close(data.buf_fds[i]);
-            data.buf_fds[i] = -1;
-        }
-        data.nfd = 0;
+    gl_f.GenFramebuffers(1, &data.fbo);
+    if (data.fbo == 0) {
+        hlog("Failed to initialize FBO");
+        return false;
     }
 
-    if (data.image) {
-        egl_f.DestroyImage(data.display, data.image);
-        data.image = NULL;
-    }
+    const bool no_modifiers = capture_allocate_no_modifiers();
+    const bool linear = capture_allocate_linear();
+    const bool map_host = capture_allocate_map_host();
+    const bool same_device = capture_compare_device_uuid(data.device_uuid);
 
-    if (data.xpixmap) {
-        x11_f.XFreePixmap(data.display, data.xpixmap);
-        data.xpixmap = 0;
-    }
+    hlog("Texture %s %ux%u", "GL_RGBA (Vulkan)", data.region.width, data.region.height);
 
-    if (data.glxpixmap) {
-        glx_f.DestroyPixmap(data.display, data.glxpixmap);
-        data.glxpixmap = NULL;
-    }
+    VkExternalMemoryImageCreateInfo ext_mem_image_info = {};
+    ext_mem_image_info.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
+    ext_mem_image_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT | VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT_KHR;
 
-    if (data.fbo) {
-        gl_f.DeleteFramebuffers(1, &data.fbo);
-        data.fbo = 0;
-    }
+    VkImageCreateInfo img_info = {};
+    img_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    img_info.pNext = &ext_mem_image_info;
+    img_info.imageType = VK_IMAGE_TYPE_2D;
+    img_info.format = VK_FORMAT_B8G8R8A8_UNORM;
+    img_info.mipLevels = 1;
+    img_info.arrayLayers = 1;
+    img_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    img_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    img_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    img_info.extent.width = data.region.width;
+    img_info.extent.height = data.region.height;
+    img_info.extent.depth = 1;
+    img_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    img_info.tiling = VK_IMAGE_TILING_LINEAR;
 
-    if (data.texture) {
-        gl_f.DeleteTextures(1, &data.texture);
-        data.texture = 0;
-    }
+    uint64_t *image_modifiers = NULL;
+    VkImageDrmFormatModifierListCreateInfoEXT image_modifier_list = {};
+    struct VkDrmFormatModifierPropertiesEXT *modifier_props = NULL;
+    uint32_t modifier_prop_count = 0;
 
-    if (data.vkimage) {
-        vk_f.DestroyImage(data.vkdev, data.vkimage, NULL);
-        data.vkimage = VK_NULL_HANDLE;
-    }
+    if (!no_modifiers && vk_f.GetImageDrmFormatModifierPropertiesEXT) {
+        VkDrmFormatModifierPropertiesListEXT modifier_props_list = {};
+        modifier_props_list.sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT;
 
-    if (data.vkmemory) {
-        vk_f.FreeMemory(data.vkdev, data.vkmemory, NULL);
-        data.vkmemory = VK_NULL_HANDLE;
-    }
+        VkFormatProperties2KHR format_props = {};
+        format_props.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
+        format_props.pNext = &modifier_props_list;
 
-    capture_stop();
+        vk_f.GetPhysicalDeviceFormatProperties2KHR(data.vkphys_dev, img_info.format, &format_props);
 
-    if (was_capturing) {
-        hlog("------------------- opengl capture freed -------------------");
-    }
-}
+        modifier_props = malloc(modifier_props_list.drmFormatModifierCount * sizeof(struct VkDrmFormatModifierPropertiesEXT));
+        modifier_props_list.pDrmFormatModifierProperties = modifier_props;
 
-static void gl_copy_backbuffer(GLuint dst)
-{
-    gl_f.Disable(GL_FRAMEBUFFER_SRGB);
-    gl_f.BindFramebuffer(GL_READ_FRAMEBUFFER, 0);
-    gl_f.BindFramebuffer(GL_DRAW_FRAMEBUFFER, data.fbo);
-    gl_f.BindTexture(GL_TEXTURE_2D, dst);
-    gl_f.FramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, dst, 0);
-    gl_f.ReadBuffer(GL_BACK);
-    gl_f.DrawBuffer(GL_COLOR_ATTACHMENT0);
-    gl_f.BlitFramebuffer(0, 0, data.width, data.height, 0, 0, data.width, data.height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
-}
+        vk_f.GetPhysicalDeviceFormatProperties2KHR(data.vkphys_dev, img_info.format, &format_props);
 
-static void gl_shtex_capture()
-{
-    GLboolean last_srgb;
-    GLint last_read_fbo;
-    GLint last_draw_fbo;
-    GLint last_tex;
+#ifndef NDEBUG
+        hlog("Available modifiers:");
+#endif
+        for (uint32_t i = 0; i < modifier_props_list.drmFormatModifierCount; i++) {
+            if (linear && modifier_props[i].drmFormatModifier != DRM_FORMAT_MOD_LINEAR) {
+                continue;
+            }
+            if (!capture_allocate_modifier(DRM_FORMAT_ABGR8888, modifier_props[i].drmFormatModifier)) {
+                continue;
+            }
+            VkPhysicalDeviceImageDrmFormatModifierInfoEXT mod_info = {};
+            mod_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT;
+            mod_info.drmFormatModifier = modifier_props[i].drmFormatModifier;
+            mod_info.sharingMode = img_info.sharingMode;
 
-    last_srgb = gl_f.IsEnabled(GL_FRAMEBUFFER_SRGB);
-    gl_f.GetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &last_read_fbo);
-    gl_f.GetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &last_draw_fbo);
-    gl_f.GetIntegerv(GL_TEXTURE_BINDING_2D, &last_tex);
+            VkPhysicalDeviceImageFormatInfo2 format_info = {};
+            format_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
+            format_info.pNext = &mod_info;
+            format_info.format = img_info.format;
+            format_info.type = VK_IMAGE_TYPE_2D;
+            format_info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+            format_info.usage = img_info.usage;
+            format_info.flags = img_info.flags;
 
-    gl_copy_backbuffer(data.texture);
+            VkImageFormatProperties2KHR format_props = {};
+            format_props.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
 
-    gl_f.BindTexture(GL_TEXTURE_2D, last_tex);
-    gl_f.BindFramebuffer(GL_DRAW_FRAMEBUFFER, last_draw_fbo);
-    gl_f.BindFramebuffer(GL_READ_FRAMEBUFFER, last_read_fbo);
-    if (last_srgb) {
-        gl_f.Enable(GL_FRAMEBUFFER_SRGB);
+            VkResult result = vk_f.GetPhysicalDeviceImageFormatProperties2KHR(data.vkphys_dev, &format_info, &format_props);
+            if (result == VK_SUCCESS) {
+#ifndef NDEBUG
+                hlog(" %d: modifier:%"PRIu64" planes:%d", i,
+                        modifier_props[i].drmFormatModifier,
+                        modifier_props[i].drmFormatModifierPlaneCount);
+#endif
+                modifier_props[modifier_prop_count++] = modifier_props[i];
+            }
+        }
+
+        if (modifier_prop_count > 0) {
+            image_modifiers = malloc(sizeof(uint64_t) * modifier_prop_count);
+            for (uint32_t i = 0; i < modifier_prop_count; ++i) {
+                image_modifiers[i] = modifier_props[i].drmFormatModifier;
+            }
+
+            image_modifier_list.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_LIST_CREATE_INFO_EXT;
+            image_modifier_list.drmFormatModifierCount = modifier_prop_count;
+            image_modifier_list.pDrmFormatModifiers = image_modifiers;
+            img_info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+            ext_mem_image_info.pNext = &image_modifier_list;
+        } else {
+            hlog("No suitable DRM modifier found!");
+        }
+    }
+
+    // Image falls back to LINEAR tiling, planes are queried by color aspect
+    const bool use_modifiers = modifier_prop_count > 0;
+    const int nslots = gl_capture_slots();
+    bool created = true;
+    for (int i = 0; i < nslots && created; ++i) {
+        data.nslots = i + 1;
+        created = vulkan_shtex_init_slot(&data.slots[i], &img_info, use_modifiers,
+                same_device, map_host, linear, modifier_props, modifier_prop_count);
+    }
+    free(image_modifiers);
+    free(modifier_props);
+
+    data.buf_fourcc = DRM_FORMAT_ABGR8888;
+
+    return created;
+}
+
+static void querySurface(void *display, void *surface, int *width, int *height)
+{
+    if (data.glx) {
+        unsigned w, h;
+        glx_f.QueryDrawable(display, surface, P_GLX_WIDTH, &w);
+        glx_f.QueryDrawable(display, surface, P_GLX_HEIGHT, &h);
+        *width = w;
+        *height = h;
     } else {
-        gl_f.Disable(GL_FRAMEBUFFER_SRGB);
+        egl_f.QuerySurface(display, surface, P_EGL_WIDTH, width);
+        egl_f.QuerySurface(display, surface, P_EGL_HEIGHT, height);
     }
 }
 
-static bool gl_shtex_init()
+/* Surfaces swapped by the app. Sizes are cached so steady state swaps make no
+ * server round trips: X windows are watched for ConfigureNotify on a separate
+ * connection and Wayland sizes are read from the wl_egl_window attached size.
+ * Surfaces that can't be watched are queried on every swap. */
+struct gl_surface {
+    void *display;
+    void *surface;
+    uintptr_t window;
+    uint32_t xwindow;
+    struct P_wl_egl_window *wl_window;
+    int width;
+    int height;
+    bool watched;
+    bool size_valid;
+    bool destroyed;
+};
+
+#define GL_SURFACE_MAX 16
+#define GL_XID_MAX 0x1fffffff
+static struct gl_surface gl_surfaces[GL_SURFACE_MAX];
+static int gl_surface_evict;
+static struct P_wl_egl_window *gl_wl_windows[GL_SURFACE_MAX];
+static pthread_mutex_t gl_surface_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct xcb_funcs xcb_f;
+static void *gl_xcb_conn;
+
+#define GETXCBADDR(func) \
+    xcb_f.func = (typeof(xcb_f.func))real_dlsym(handle, #func); \
+    if (!xcb_f.func) { \
+        hlog("Failed to resolve " #func); \
+        return NULL; \
+    } \
+
+static void *gl_surface_xcb(const char *display_name)
 {
-    if (vkcapture_glvulkan) {
-        return false;
+    static bool tried = false;
+    if (tried) {
+        return gl_xcb_conn;
     }
+    tried = true;
 
-    if (data.glx) {
-        // GLX on NVIDIA is all kinds of broken...
-        const char *vendor = (const char*)gl_f.GetString(GL_VENDOR);
-        if (strcmp(vendor, "NVIDIA Corporation") == 0) {
-            return false;
+    void *handle = dlopen("libxcb.so.1", RTLD_LAZY);
+    if (!handle) {
+        return NULL;
+    }
+    GETXCBADDR(xcb_connect);
+    GETXCBADDR(xcb_connection_has_error);
+    GETXCBADDR(xcb_disconnect);
+    GETXCBADDR(xcb_change_window_attributes);
+    GETXCBADDR(xcb_flush);
+    GETXCBADDR(xcb_poll_for_event);
+    xcb_f.valid = true;
+
+    void *conn = xcb_f.xcb_connect(display_name, NULL);
+    if (xcb_f.xcb_connection_has_error(conn)) {
+        xcb_f.xcb_disconnect(conn);
+        return NULL;
+    }
+    gl_xcb_conn = conn;
+    return conn;
+}
+
+#undef GETXCBADDR
+
+// Called with gl_surface_mutex locked
+static void gl_surface_poll()
+{
+    if (!gl_xcb_conn) {
+        return;
+    }
+
+    void *event;
+    while ((event = xcb_f.xcb_poll_for_event(gl_xcb_conn))) {
+        const uint8_t type = ((const uint8_t*)event)[0] & 0x7f;
+        for (int i = 0; i < GL_SURFACE_MAX; ++i) {
+            struct gl_surface *s = &gl_surfaces[i];
+            if (!s->surface || !s->xwindow) {
+                continue;
+            }
+            if (type == 0 && ((const P_xcb_generic_error_t*)event)->resource_id == s->xwindow) {
+                // Not a window (eg. GLXWindow), query it instead
+                s->xwindow = 0;
+                s->size_valid = false;
+            } else if (type == P_XCB_CONFIGURE_NOTIFY
+                    && ((const P_xcb_configure_notify_event_t*)event)->window == s->xwindow) {
+                const P_xcb_configure_notify_event_t *ev = event;
+                s->width = ev->width;
+                s->height = ev->height;
+            } else if (type == P_XCB_DESTROY_NOTIFY
+                    && ((const P_xcb_destroy_notify_event_t*)event)->window == s->xwindow) {
+                s->destroyed = true;
+            }
         }
+        free(event);
     }
+}
 
-    gl_f.GenFramebuffers(1, &data.fbo);
-    if (data.fbo == 0) {
-        hlog("Failed to initialize FBO");
-        return false;
+// Called with gl_surface_mutex locked
+static struct gl_surface *gl_surface_get(void *display, void *surface, bool create)
+{
+    struct gl_surface *unused = NULL;
+    for (int i = 0; i < GL_SURFACE_MAX; ++i) {
+        struct gl_surface *s = &gl_surfaces[i];
+        if (s->surface == surface && s->display == display) {
+            return s;
+        }
+        if (!unused && (!s->surface || (s->destroyed && s->surface != data.surface))) {
+            unused = s;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    for (int i = 0; i < GL_SURFACE_MAX && !unused; ++i) {
+        // Captured surface is never evicted
+        struct gl_surface *s = &gl_surfaces[gl_surface_evict++ % GL_SURFACE_MAX];
+        if (s->surface != data.surface) {
+            unused = s;
+        }
+    }
+    memset(unused, 0, sizeof(struct gl_surface));
+    unused->display = display;
+    unused->surface = surface;
+    return unused;
+}
+
+// Called with gl_surface_mutex locked
+static void gl_surface_watch(struct gl_surface *s, uintptr_t window, const char *display_name)
+{
+    s->watched = true;
+    s->window = window;
+
+    for (int i = 0; i < GL_SURFACE_MAX; ++i) {
+        if (gl_wl_windows[i] && (uintptr_t)gl_wl_windows[i] == window) {
+            // Unknown layout, eglQuerySurface makes no round trip on Wayland
+            const intptr_t version = gl_wl_windows[i]->version;
+            if (version >= P_WL_EGL_WINDOW_VERSION_MIN && version <= P_WL_EGL_WINDOW_VERSION_MAX) {
+                s->wl_window = gl_wl_windows[i];
+            }
+            return;
+        }
     }
 
-    hlog("Texture %s %ux%u", "GL_RGBA", data.width, data.height);
+    // X window ids have the top three bits clear
+    if (!window || window > GL_XID_MAX) {
+        return;
+    }
+    void *conn = gl_surface_xcb(display_name);
+    if (!conn) {
+        return;
+    }
+    const uint32_t mask = P_XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+    xcb_f.xcb_change_window_attributes(conn, window, P_XCB_CW_EVENT_MASK, &mask);
+    xcb_f.xcb_flush(conn);
+    s->xwindow = window;
+}
 
-    gl_f.GenTextures(1, &data.texture);
-    gl_f.BindTexture(GL_TEXTURE_2D, data.texture);
-    gl_f.TexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, data.width, data.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+static void gl_surface_created(void *display, void *surface, void *window)
+{
+    pthread_mutex_lock(&gl_surface_mutex);
+    struct gl_surface *s = gl_surface_get(display, surface, false);
+    if (s) {
+        // Handle of a destroyed surface was reused
+        s->surface = NULL;
+    }
+    gl_surface_watch(gl_surface_get(display, surface, true), (uintptr_t)window, NULL);
+    pthread_mutex_unlock(&gl_surface_mutex);
+}
+
+static void gl_surface_destroyed(void *display, void *surface)
+{
+    pthread_mutex_lock(&gl_surface_mutex);
+    struct gl_surface *s = gl_surface_get(display, surface, false);
+    if (s) {
+        s->destroyed = true;
+    }
+    pthread_mutex_unlock(&gl_surface_mutex);
+}
+
+static bool gl_surface_is_destroyed(void *display, void *surface)
+{
+    pthread_mutex_lock(&gl_surface_mutex);
+    gl_surface_poll();
+    struct gl_surface *s = gl_surface_get(display, surface, false);
+    const bool destroyed = s && s->destroyed;
+    pthread_mutex_unlock(&gl_surface_mutex);
+    return destroyed;
+}
+
+static void gl_surface_size(void *display, void *surface, int *width, int *height, uintptr_t *window)
+{
+    pthread_mutex_lock(&gl_surface_mutex);
+    gl_surface_poll();
+    struct gl_surface *s = gl_surface_get(display, surface, true);
+    if (!s->watched) {
+        gl_surface_watch(s, data.glx ? (uintptr_t)surface : 0,
+                data.glx ? ((P_XPrivDisplay)display)->display_name : NULL);
+    }
+    if (s->wl_window && s->wl_window->attached_width > 0) {
+        // Requested size only applies to the next buffer
+        s->width = s->wl_window->attached_width;
+        s->height = s->wl_window->attached_height;
+    } else if (!s->size_valid) {
+        querySurface(display, surface, &s->width, &s->height);
+        // Watched windows are kept up to date by ConfigureNotify
+        s->size_valid = s->xwindow;
+    }
+    *width = s->width;
+    *height = s->height;
+    if (window) {
+        *window = s->window;
+    }
+    pthread_mutex_unlock(&gl_surface_mutex);
+}
+
+static void gl_slot_free(struct gl_slot *slot)
+{
+    for (int i = 0; i < slot->buf.nfd; ++i) {
+        close(slot->buf.fds[i]);
+        slot->buf.fds[i] = -1;
+    }
+    slot->buf.nfd = 0;
+
+    if (slot->image) {
+        egl_f.DestroyImage(data.display, slot->image);
+        slot->image = NULL;
+    }
+
+    if (slot->xpixmap) {
+        x11_f.XFreePixmap(data.display, slot->xpixmap);
+        slot->xpixmap = 0;
+    }
+
+    if (slot->glxpixmap) {
+        glx_f.DestroyPixmap(data.display, slot->glxpixmap);
+        slot->glxpixmap = NULL;
+    }
+
+    if (slot->texture) {
+        gl_f.DeleteTextures(1, &slot->texture);
+        slot->texture = 0;
+    }
+
+    if (slot->vkimage) {
+        vk_f.DestroyImage(data.vkdev, slot->vkimage, NULL);
+        slot->vkimage = VK_NULL_HANDLE;
+    }
+
+    if (slot->vkmemory) {
+        vk_f.FreeMemory(data.vkdev, slot->vkmemory, NULL);
+        slot->vkmemory = VK_NULL_HANDLE;
+    }
+}
+
+static void gl_free()
+{
+    const bool was_capturing = data.nslots;
+
+    for (int i = 0; i < data.nslots; ++i) {
+        gl_slot_free(&data.slots[i]);
+    }
+    data.nslots = 0;
+    data.slot = 0;
+    data.context = NULL;
+
+    for (int i = 0; i < GL_READBACK_SLOTS; ++i) {
+        if (data.pbo_fences[i]) {
+            gl_f.DeleteSync(data.pbo_fences[i]);
+            data.pbo_fences[i] = NULL;
+        }
+        if (data.pbos[i]) {
+            gl_f.DeleteBuffers(1, &data.pbos[i]);
+            data.pbos[i] = 0;
+        }
+    }
+    data.pbo_index = 0;
+    data.readback_stale = false;
+
+    for (int i = 0; i < GL_READBACK_BUFFERS; ++i) {
+        if (data.readback_maps[i]) {
+            munmap(data.readback_maps[i], data.readback_size);
+            data.readback_maps[i] = NULL;
+        }
+    }
+
+    if (data.fbo) {
+        gl_f.DeleteFramebuffers(1, &data.fbo);
+        data.fbo = 0;
+    }
+
+    capture_stop();
+
+    if (was_capturing) {
+        hlog("------------------- opengl capture freed -------------------");
+    }
+}
+
+static void gl_copy_backbuffer(GLuint dst, const struct capture_region *rect)
+{
+    gl_f.Disable(GL_FRAMEBUFFER_SRGB);
+    gl_f.BindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    gl_f.BindFramebuffer(GL_DRAW_FRAMEBUFFER, data.fbo);
+    gl_f.FramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, dst, 0);
+    gl_f.ReadBuffer(GL_BACK);
+    gl_f.DrawBuffer(GL_COLOR_ATTACHMENT0);
+    // Region is top-down, backbuffer and rect are bottom-up
+    const GLint x0 = data.region.x + rect->x;
+    const GLint y0 = data.height - data.region.y - data.region.height + rect->y;
+    gl_f.BlitFramebuffer(x0, y0, x0 + rect->width, y0 + rect->height,
+            rect->x, rect->y, rect->x + rect->width, rect->y + rect->height,
+            GL_COLOR_BUFFER_BIT, GL_LINEAR);
+}
+
+static void gl_damage_add(struct capture_region *dst, const struct capture_region *rect)
+{
+    if (rect->width <= 0 || rect->height <= 0) {
+        return;
+    }
+    if (dst->width <= 0 || dst->height <= 0) {
+        *dst = *rect;
+        return;
+    }
+    const int x1 = MAX(dst->x + dst->width, rect->x + rect->width);
+    const int y1 = MAX(dst->y + dst->height, rect->y + rect->height);
+    dst->x = MIN(dst->x, rect->x);
+    dst->y = MIN(dst->y, rect->y);
+    dst->width = x1 - dst->x;
+    dst->height = y1 - dst->y;
+}
+
+// Bounding box of swap damage in texture coordinates, no rects means everything
+static void gl_frame_damage(const int *rects, int n_rects, struct capture_region *damage)
+{
+    const int x0 = data.region.x;
+    const int y0 = data.height - data.region.y - data.region.height;
+
+    if (!rects || n_rects <= 0) {
+        *damage = (struct capture_region){0, 0, data.region.width, data.region.height};
+        return;
+    }
+
+    memset(damage, 0, sizeof(*damage));
+    for (int i = 0; i < n_rects; ++i) {
+        const int *r = &rects[i * 4];
+        const int x = MAX(r[0] - x0, 0);
+        const int y = MAX(r[1] - y0, 0);
+        struct capture_region rect = {
+            .x = x,
+            .y = y,
+            .width = MIN(r[0] - x0 + r[2], data.region.width) - x,
+            .height = MIN(r[1] - y0 + r[3], data.region.height) - y,
+        };
+        gl_damage_add(damage, &rect);
+    }
+}
+
+static void gl_state_save(struct gl_state *state)
+{
+    state->srgb = gl_f.IsEnabled(GL_FRAMEBUFFER_SRGB);
+    gl_f.GetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &state->read_fbo);
+    gl_f.GetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &state->draw_fbo);
+}
+
+static void gl_shtex_capture()
+{
+    struct gl_state state;
+    gl_state_save(&state);
+
+    data.slot = capture_next_slot(data.slot, data.nslots);
+    struct gl_slot *slot = &data.slots[data.slot];
+    gl_copy_backbuffer(slot->texture, &slot->damage);
+    memset(&slot->damage, 0, sizeof(slot->damage));
+
+    gl_f.BindFramebuffer(GL_DRAW_FRAMEBUFFER, state.draw_fbo);
+    gl_f.BindFramebuffer(GL_READ_FRAMEBUFFER, state.read_fbo);
+    if (state.srgb) {
+        gl_f.Enable(GL_FRAMEBUFFER_SRGB);
+    } else {
+        gl_f.Disable(GL_FRAMEBUFFER_SRGB);
+    }
+}
+
+static int gl_export_fence()
+{
+    if (!data.native_fence) {
+        return -1;
+    }
+
+    void *sync = egl_f.CreateSyncKHR(data.display, P_EGL_SYNC_NATIVE_FENCE_ANDROID, NULL);
+    if (!sync) {
+        return -1;
+    }
+    // Fence fd only exists once the fence was flushed
+    gl_f.Flush();
+    const int fd = egl_f.DupNativeFenceFDANDROID(data.display, sync);
+    egl_f.DestroySyncKHR(data.display, sync);
+    return fd;
+}
+
+static bool gl_shtex_init_slot(struct gl_slot *slot)
+{
+    gl_f.GenTextures(1, &slot->texture);
+    gl_f.BindTexture(GL_TEXTURE_2D, slot->texture);
+    gl_f.TexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, data.region.width, data.region.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
     gl_f.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl_f.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
     if (data.glx) {
         unsigned long root = P_DefaultRootWindow(data.display);
-        data.xpixmap = x11_f.XCreatePixmap(data.display, root, data.width, data.height, 24);
+        slot->xpixmap = x11_f.XCreatePixmap(data.display, root, data.region.width, data.region.height, 24);
 
         const int pixmap_config[] = {
             P_GLX_BIND_TO_TEXTURE_RGBA_EXT, true,
@@ -857,7 +1273,7 @@ static bool gl_shtex_init()
         void **fbc = glx_f.ChooseFBConfig(data.display, P_DefaultScreen(data.display), pixmap_config, &nelements);
         if (nelements <= 0) {
             hlog("Failed to choose FBConfig");
-            goto fail;
+            return false;
         }
 
         const int pixmapAttribs[] = {
@@ -866,41 +1282,76 @@ static bool gl_shtex_init()
             P_GLX_MIPMAP_TEXTURE_EXT, false,
             0
         };
-        data.glxpixmap = glx_f.CreatePixmap(data.display, fbc[0], data.xpixmap, pixmapAttribs);
+        slot->glxpixmap = glx_f.CreatePixmap(data.display, fbc[0], slot->xpixmap, pixmapAttribs);
         x11_f.XFree(fbc);
 
-        glx_f.BindTexImageEXT(data.display, data.glxpixmap, P_GLX_FRONT_LEFT_EXT, NULL);
+        glx_f.BindTexImageEXT(data.display, slot->glxpixmap, P_GLX_FRONT_LEFT_EXT, NULL);
 
         void *xcb_con = x11_f.XGetXCBConnection(data.display);
-        P_xcb_dri3_buffers_from_pixmap_cookie_t cookie = x11_f.xcb_dri3_buffers_from_pixmap(xcb_con, data.xpixmap);
+        P_xcb_dri3_buffers_from_pixmap_cookie_t cookie = x11_f.xcb_dri3_buffers_from_pixmap(xcb_con, slot->xpixmap);
         P_xcb_dri3_buffers_from_pixmap_reply_t *reply = x11_f.xcb_dri3_buffers_from_pixmap_reply(xcb_con, cookie, NULL);
         if (!reply) {
             hlog("Failed to get buffer from pixmap");
-            goto fail;
+            return false;
         }
-        data.nfd = reply->nfd;
+        slot->buf.nfd = reply->nfd;
         for (uint8_t i = 0; i < reply->nfd; ++i) {
-            data.buf_fds[i] = x11_f.xcb_dri3_buffers_from_pixmap_reply_fds(xcb_con, reply)[i];
-            data.buf_strides[i] = x11_f.xcb_dri3_buffers_from_pixmap_strides(reply)[i];
-            data.buf_offsets[i] = x11_f.xcb_dri3_buffers_from_pixmap_offsets(reply)[i];
+            slot->buf.fds[i] = x11_f.xcb_dri3_buffers_from_pixmap_reply_fds(xcb_con, reply)[i];
+            slot->buf.strides[i] = x11_f.xcb_dri3_buffers_from_pixmap_strides(reply)[i];
+            slot->buf.offsets[i] = x11_f.xcb_dri3_buffers_from_pixmap_offsets(reply)[i];
         }
         data.buf_fourcc = DRM_FORMAT_ARGB8888;
-        data.buf_modifier = reply->modifier;
+        slot->buf.modifier = reply->modifier;
         free(reply);
     } else {
-        data.image = egl_f.CreateImage(data.display, egl_f.GetCurrentContext(), P_EGL_GL_TEXTURE_2D, data.texture, NULL);
-        if (!data.image) {
+        slot->image = egl_f.CreateImage(data.display, egl_f.GetCurrentContext(), P_EGL_GL_TEXTURE_2D, slot->texture, NULL);
+        if (!slot->image) {
             hlog("Failed to create EGL image");
-            goto fail;
+            return false;
         }
-        const int queried = egl_f.ExportDMABUFImageQueryMESA(data.display, data.image, &data.buf_fourcc, &data.nfd, &data.buf_modifier);
+        int nfd = 0;
+        const int queried = egl_f.ExportDMABUFImageQueryMESA(data.display, slot->image, &data.buf_fourcc, &nfd, &slot->buf.modifier);
         if (!queried) {
             hlog("Failed to query dmabuf export");
-            goto fail;
+            return false;
         }
-        const int exported = egl_f.ExportDMABUFImageMESA(data.display, data.image, data.buf_fds, data.buf_strides, data.buf_offsets);
+        const int exported = egl_f.ExportDMABUFImageMESA(data.display, slot->image, slot->buf.fds, slot->buf.strides, slot->buf.offsets);
         if (!exported) {
             hlog("Failed dmabuf export");
+            return false;
+        }
+        slot->buf.nfd = nfd;
+    }
+
+    return true;
+}
+
+static bool gl_shtex_init()
+{
+    if (vkcapture_glvulkan) {
+        return false;
+    }
+
+    if (data.glx) {
+        // GLX on NVIDIA is all kinds of broken...
+        const char *vendor = (const char*)gl_f.GetString(GL_VENDOR);
+        if (strcmp(vendor, "NVIDIA Corporation") == 0) {
+            return false;
+        }
+    }
+
+    gl_f.GenFramebuffers(1, &data.fbo);
+    if (data.fbo == 0) {
+        hlog("Failed to initialize FBO");
+        return false;
+    }
+
+    hlog("Texture %s %ux%u", "GL_RGBA", data.region.width, data.region.height);
+
+    const int nslots = gl_capture_slots();
+    for (int i = 0; i < nslots; ++i) {
+        data.nslots = i + 1;
+        if (!gl_shtex_init_slot(&data.slots[i])) {
             goto fail;
         }
     }
@@ -908,34 +1359,202 @@ static bool gl_shtex_init()
     return true;
 
 fail:
-    data.nfd = 0;
+    for (int i = 0; i < data.nslots; ++i) {
+        gl_slot_free(&data.slots[i]);
+    }
+    data.nslots = 0;
     if (data.fbo) {
         gl_f.DeleteFramebuffers(1, &data.fbo);
         data.fbo = 0;
     }
-    if (data.xpixmap) {
-        x11_f.XFreePixmap(data.display, data.xpixmap);
-        data.xpixmap = 0;
+    return false;
+}
+
+static bool gl_has_extension(const char *name)
+{
+    const char *version = (const char*)gl_f.GetString(GL_VERSION);
+    if (!version) {
+        return false;
     }
-    if (data.glxpixmap) {
-        glx_f.DestroyPixmap(data.display, data.glxpixmap);
-        data.glxpixmap = NULL;
+
+    // Core profiles only list extensions with glGetStringi
+    const char *number = strncmp(version, "OpenGL ES", 9) == 0 ? strchr(version + 9, ' ') : version;
+    if (number && atoi(number) >= 3) {
+        GLint count = 0;
+        gl_f.GetIntegerv(GL_NUM_EXTENSIONS, &count);
+        for (GLint i = 0; i < count; ++i) {
+            const char *ext = (const char*)gl_f.GetStringi(GL_EXTENSIONS, i);
+            if (ext && strcmp(ext, name) == 0) {
+                return true;
+            }
+        }
+        return false;
     }
-    if (data.image) {
-        egl_f.DestroyImage(data.display, data.image);
-        data.image = NULL;
+
+    const char *exts = (const char*)gl_f.GetString(GL_EXTENSIONS);
+    const size_t len = strlen(name);
+    for (const char *ext = exts; ext && (ext = strstr(ext, name)); ext += len) {
+        if ((ext == exts || ext[-1] == ' ') && (ext[len] == ' ' || ext[len] == '\0')) {
+            return true;
+        }
     }
     return false;
 }
 
+static bool gl_readback_init()
+{
+    const int stride = data.region.width * 4;
+    const size_t size = (size_t)stride * data.region.height;
+
+    // GLES only reads BGRA with EXT_read_format_bgra
+    const char *version = (const char*)gl_f.GetString(GL_VERSION);
+    if (version && strncmp(version, "OpenGL ES", 9) == 0 && !gl_has_extension("GL_EXT_read_format_bgra")) {
+        data.readback_format = GL_RGBA;
+        data.buf_fourcc = DRM_FORMAT_ABGR8888;
+    } else {
+        data.readback_format = GL_BGRA;
+        data.buf_fourcc = DRM_FORMAT_ARGB8888;
+    }
+
+    data.readback_size = size;
+    for (int i = 0; i < GL_READBACK_BUFFERS; ++i) {
+        const int fd = memfd_create("obs-vkcapture", MFD_CLOEXEC);
+        if (fd < 0) {
+            hlog("Failed to create memfd %s", strerror(errno));
+            return false;
+        }
+        struct gl_slot *slot = &data.slots[i];
+        slot->buf.nfd = 1;
+        slot->buf.fds[0] = fd;
+        slot->buf.strides[0] = stride;
+        slot->buf.offsets[0] = 0;
+        slot->buf.modifier = DRM_FORMAT_MOD_LINEAR;
+        data.nslots = i + 1;
+
+        if (ftruncate(fd, size) < 0) {
+            hlog("Failed to resize memfd %s", strerror(errno));
+            return false;
+        }
+        data.readback_maps[i] = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data.readback_maps[i] == MAP_FAILED) {
+            hlog("Failed to map memfd %s", strerror(errno));
+            data.readback_maps[i] = NULL;
+            return false;
+        }
+    }
+
+    hlog("Texture %s %ux%u", data.readback_format == GL_BGRA ? "GL_BGRA (readback)" : "GL_RGBA (readback)",
+        data.region.width, data.region.height);
+
+    GLint last_pbo;
+    gl_f.GetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &last_pbo);
+    gl_f.GenBuffers(GL_READBACK_SLOTS, data.pbos);
+    for (int i = 0; i < GL_READBACK_SLOTS; ++i) {
+        gl_f.BindBuffer(GL_PIXEL_PACK_BUFFER, data.pbos[i]);
+        gl_f.BufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+    }
+    gl_f.BindBuffer(GL_PIXEL_PACK_BUFFER, last_pbo);
+
+    return true;
+}
+
+// Frames read before capture was paused are outdated once it resumes
+static void gl_readback_drop()
+{
+    for (int i = 0; i < GL_READBACK_SLOTS; ++i) {
+        if (data.pbo_fences[i]) {
+            gl_f.DeleteSync(data.pbo_fences[i]);
+            data.pbo_fences[i] = NULL;
+        }
+    }
+    data.readback_stale = false;
+}
+
+// Copies the oldest pending readback into the next memfd, returns true if there was one
+static bool gl_readback_copy(int index)
+{
+    if (!data.pbo_fences[index]) {
+        return false;
+    }
+
+    // Read three captures ago, usually signaled already
+    gl_f.ClientWaitSync(data.pbo_fences[index], GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_C(1000000000));
+    gl_f.DeleteSync(data.pbo_fences[index]);
+    data.pbo_fences[index] = NULL;
+
+    gl_f.BindBuffer(GL_PIXEL_PACK_BUFFER, data.pbos[index]);
+    const void *pixels = gl_f.MapBufferRange(GL_PIXEL_PACK_BUFFER, 0, data.readback_size, GL_MAP_READ_BIT);
+    if (!pixels) {
+        return false;
+    }
+    data.slot = capture_next_slot(data.slot, data.nslots);
+    memcpy(data.readback_maps[data.slot], pixels, data.readback_size);
+    gl_f.UnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    return true;
+}
+
+static bool gl_readback_capture()
+{
+    struct gl_state state;
+    gl_state_save(&state);
+
+    if (data.readback_stale) {
+        gl_readback_drop();
+    }
+
+    // Pack state is changed too
+    GLint last_pbo;
+    GLint pack[4];
+    const GLenum pack_params[4] = {GL_PACK_ALIGNMENT, GL_PACK_ROW_LENGTH, GL_PACK_SKIP_ROWS, GL_PACK_SKIP_PIXELS};
+    gl_f.GetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &last_pbo);
+    for (int i = 0; i < 4; ++i) {
+        gl_f.GetIntegerv(pack_params[i], &pack[i]);
+    }
+
+    data.pbo_index = (data.pbo_index + 1) % GL_READBACK_SLOTS;
+    const int index = data.pbo_index;
+    const bool copied = gl_readback_copy(index);
+
+    gl_f.BindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    gl_f.ReadBuffer(GL_BACK);
+    gl_f.BindBuffer(GL_PIXEL_PACK_BUFFER, data.pbos[index]);
+    gl_f.PixelStorei(GL_PACK_ALIGNMENT, 4);
+    gl_f.PixelStorei(GL_PACK_ROW_LENGTH, 0);
+    gl_f.PixelStorei(GL_PACK_SKIP_ROWS, 0);
+    gl_f.PixelStorei(GL_PACK_SKIP_PIXELS, 0);
+    // Region is top-down, backbuffer is bottom-up
+    const GLint x0 = data.region.x;
+    const GLint y0 = data.height - data.region.y - data.region.height;
+    gl_f.ReadPixels(x0, y0, data.region.width, data.region.height, data.readback_format, GL_UNSIGNED_BYTE, NULL);
+    data.pbo_fences[index] = gl_f.FenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    for (int i = 0; i < 4; ++i) {
+        gl_f.PixelStorei(pack_params[i], pack[i]);
+    }
+    gl_f.BindBuffer(GL_PIXEL_PACK_BUFFER, last_pbo);
+    gl_f.BindFramebuffer(GL_READ_FRAMEBUFFER, state.read_fbo);
+
+    return copied;
+}
+
 static bool gl_init(void *display, void *surface)
 {
+    uintptr_t window;
     data.display = display;
     data.surface = surface;
-    querySurface(&data.width, &data.height);
+    data.context = data.glx ? glx_f.GetCurrentContext() : egl_f.GetCurrentContext();
+    gl_surface_size(display, surface, &data.width, &data.height, &window);
+    capture_allocate_region(data.width, data.height, &data.region);
+    if (data.region.width != data.width || data.region.height != data.height) {
+        hlog("Region %d,%d %dx%d", data.region.x, data.region.y, data.region.width, data.region.height);
+    }
 
-    if (data.glx) {
-        data.winid = (uintptr_t)surface;
+    // Native EGL window is a pointer on Wayland
+    data.winid = window <= GL_XID_MAX ? window : 0;
+    if (!data.glx) {
+        const char *exts = egl_f.QueryString(display, P_EGL_EXTENSIONS);
+        data.native_fence = exts && strstr(exts, "EGL_ANDROID_native_fence_sync")
+            && egl_f.CreateSyncKHR && egl_f.DestroySyncKHR && egl_f.DupNativeFenceFDANDROID;
     }
 
     GLint last_tex;
@@ -945,6 +1564,10 @@ static bool gl_init(void *display, void *surface)
     if (!init) {
         init = vulkan_shtex_init();
     }
+    // Readback buffers are only uploaded on frame data
+    if (!init && capture_allocate_frames()) {
+        init = gl_readback_init();
+    }
 
     gl_f.BindTexture(GL_TEXTURE_2D, last_tex);
 
@@ -953,23 +1576,59 @@ static bool gl_init(void *display, void *surface)
         return false;
     }
 
-    capture_init_shtex(data.width, data.height, data.buf_fourcc,
-            data.buf_strides, data.buf_offsets, data.buf_modifier,
-            data.winid, /*flip*/true, 0, data.nfd, data.buf_fds);
+    if (data.readback_maps[0]) {
+        int fds[GL_READBACK_BUFFERS];
+        for (int i = 0; i < data.nslots; ++i) {
+            fds[i] = data.slots[i].buf.fds[0];
+        }
+        capture_init_shtex_memfd(data.region.width, data.region.height, data.buf_fourcc,
+                data.slots[0].buf.strides[0], data.winid, /*flip*/true, 0, data.nslots, fds);
+    } else {
+        if (data.nslots > 1) {
+            hlog("Using %d textures", data.nslots);
+        }
+
+        struct capture_buffer buffers[CAPTURE_MAX_SLOTS];
+        for (int i = 0; i < data.nslots; ++i) {
+            buffers[i] = data.slots[i].buf;
+            data.slots[i].damage = (struct capture_region){0, 0, data.region.width, data.region.height};
+        }
+        memset(&data.damage, 0, sizeof(data.damage));
+
+        capture_init_shtex_ring(data.region.width, data.region.height, data.buf_fourcc,
+                data.winid, /*flip*/true, 0, data.nslots, buffers);
+    }
 
     hlog("------------------ opengl capture started ------------------");
 
     return true;
 }
 
-static void gl_capture(void *display, void *surface)
+static void gl_capture(void *display, void *surface, const int *rects, int n_rects)
 {
     capture_update_socket();
 
+    // Queried only for OBS, so apps don't see errors from it otherwise
+    if (!data.device_queried && capture_connected()) {
+        data.device_queried = true;
+        if (gl_has_extension("GL_EXT_memory_object")) {
+            uint8_t driver_uuid[16] = {0};
+            gl_f.GetUnsignedBytei_vEXT(GL_DEVICE_UUID_EXT, 0, data.device_uuid);
+            gl_f.GetUnsignedBytei_vEXT(GL_DRIVER_UUID_EXT, 0, driver_uuid);
+            capture_set_device(data.device_uuid, driver_uuid);
+        }
+        vulkan_prewarm();
+    }
+
     if (capture_should_stop()) {
         gl_free();
     }
 
+    if (capture_ready() && data.surface != surface && gl_surface_is_destroyed(data.display, data.surface)) {
+        // Captured surface is gone, continue with the one still swapping
+        gl_free();
+    }
+
     if (capture_should_init()) {
         if (!gl_init(display, surface)) {
             gl_free();
@@ -980,14 +1639,40 @@ static void gl_capture(void *display, void *surface)
 
     if (capture_ready() && data.surface == surface) {
         int width, height;
-        querySurface(&width, &height);
+        gl_surface_size(display, surface, &width, &height, NULL);
         if (data.height != height || data.width != width) {
             if (width != 0 && height != 0) {
                 gl_free();
             }
             return;
         }
-        gl_shtex_capture();
+        // Accumulated while paused too, slots are written with everything they missed
+        struct capture_region damage;
+        gl_frame_damage(rects, n_rects, &damage);
+        gl_damage_add(&data.damage, &damage);
+        for (int i = 0; i < data.nslots; ++i) {
+            gl_damage_add(&data.slots[i].damage, &damage);
+        }
+        if (!capture_should_copy()) {
+            data.readback_stale = true;
+            return;
+        }
+        if (data.readback_maps[0]) {
+            if (gl_readback_capture()) {
+                capture_frame_copied(data.slot, -1, NULL);
+            }
+        } else if (data.slots[data.slot].damage.width <= 0) {
+            // Nothing changed since the newest slot was written
+            capture_frame_copied(data.slot, -1, &data.damage);
+        } else {
+            gl_shtex_capture();
+            const int fence_fd = gl_export_fence();
+            capture_frame_copied(data.slot, fence_fd, &data.damage);
+            if (fence_fd >= 0) {
+                close(fence_fd);
+            }
+        }
+        memset(&data.damage, 0, sizeof(data.damage));
     }
 }
 
@@ -996,37 +1681,127 @@ static void gl_capture(void *display, void *surface)
 void *eglGetProcAddress(const char *procName);
 unsigned eglDestroyContext(void *display, void *context);
 unsigned eglSwapBuffers(void *display, void *surface);
+unsigned eglSwapBuffersWithDamageKHR(void *display, void *surface, const int *rects, int n_rects);
+unsigned eglSwapBuffersWithDamageEXT(void *display, void *surface, const int *rects, int n_rects);
 void *eglCreateWindowSurface(void *display, void *config, void *win, const intptr_t *attrib_list);
+unsigned eglDestroySurface(void *display, void *surface);
+void *wl_egl_window_create(void *surface, int width, int height);
+void wl_egl_window_destroy(void *window);
+void *glXGetProcAddress(const char *procName);
+void *glXGetProcAddressARB(const char *procName);
+void glXDestroyContext(void *display, void *context);
+void glXSwapBuffers(void *display, void *surface);
+int64_t glXSwapBuffersMscOML(void *display, void *drawable, int64_t target_msc, int64_t divisor, int64_t remainder);
+
+#define HOOK_EGL (1 << 0)
+#define HOOK_GLX (1 << 1)
 
-static struct {
+static const struct {
     void *func;
     const char *name;
-} egl_hooks_map[] = {
-#define ADD_HOOK(fn) { (void*)fn, #fn }
-    ADD_HOOK(eglGetProcAddress),
-    ADD_HOOK(eglSwapBuffers),
-    ADD_HOOK(eglDestroyContext),
-    ADD_HOOK(eglCreateWindowSurface)
+    int api;
+} hooks_map[] = {
+#define ADD_HOOK(fn, api) { (void*)fn, #fn, api }
+    ADD_HOOK(eglGetProcAddress, HOOK_EGL),
+    ADD_HOOK(eglSwapBuffers, HOOK_EGL),
+    ADD_HOOK(eglSwapBuffersWithDamageKHR, HOOK_EGL),
+    ADD_HOOK(eglSwapBuffersWithDamageEXT, HOOK_EGL),
+    ADD_HOOK(eglDestroyContext, HOOK_EGL),
+    ADD_HOOK(eglCreateWindowSurface, HOOK_EGL),
+    ADD_HOOK(eglDestroySurface, HOOK_EGL),
+    ADD_HOOK(wl_egl_window_create, HOOK_EGL),
+    ADD_HOOK(wl_egl_window_destroy, HOOK_EGL),
+    ADD_HOOK(glXGetProcAddress, HOOK_GLX),
+    ADD_HOOK(glXGetProcAddressARB, HOOK_GLX),
+    ADD_HOOK(glXSwapBuffers, HOOK_GLX),
+    ADD_HOOK(glXSwapBuffersMscOML, HOOK_GLX),
+    ADD_HOOK(glXDestroyContext, HOOK_GLX)
 #undef ADD_HOOK
 };
 
-void *obs_vkcapture_eglGetProcAddress(const char *name)
+#define HOOKS_COUNT (sizeof(hooks_map) / sizeof(hooks_map[0]))
+#define HOOKS_HASH_SIZE 128
+
+/* Every dlsym in the process goes through here. Hooks are found with a
+ * perfect hash, the seed is searched once so each hook has its own bucket
+ * and a lookup is one hash and one strcmp. */
+static uint8_t hooks_hash[HOOKS_HASH_SIZE]; // Index + 1, 0 = no hook
+static uint32_t hooks_hash_seed;
+static pthread_once_t hooks_hash_once = PTHREAD_ONCE_INIT;
+
+static uint32_t hook_hash(const char *name, uint32_t seed)
+{
+    // FNV-1a
+    uint32_t hash = UINT32_C(2166136261) ^ seed;
+    for (; *name; ++name) {
+        hash = (hash ^ (uint8_t)*name) * UINT32_C(16777619);
+    }
+    return hash & (HOOKS_HASH_SIZE - 1);
+}
+
+static void hooks_hash_init()
 {
-    for (int i = 0; i < sizeof(egl_hooks_map) / sizeof(egl_hooks_map[0]); ++i) {
-        if (strcmp(name, egl_hooks_map[i].name) == 0) {
-            return egl_hooks_map[i].func;
+    static_assert(HOOKS_COUNT < HOOKS_HASH_SIZE / 2, "hash table too small");
+
+    for (uint32_t seed = 0;; ++seed) {
+        bool collision = false;
+        memset(hooks_hash, 0, sizeof(hooks_hash));
+        for (size_t i = 0; i < HOOKS_COUNT && !collision; ++i) {
+            uint8_t *bucket = &hooks_hash[hook_hash(hooks_map[i].name, seed)];
+            collision = *bucket;
+            *bucket = i + 1;
+        }
+        if (!collision) {
+            hooks_hash_seed = seed;
+            return;
         }
     }
-    return NULL;
 }
 
+static void *gl_hook_lookup(const char *name, int api)
+{
+    // Everything hooked starts with gl, egl or wl_egl
+    if (!(name[0] == 'g' && name[1] == 'l') && !(name[0] == 'e' && name[1] == 'g')
+        && !(name[0] == 'w' && name[1] == 'l')) {
+        return NULL;
+    }
+
+    pthread_once(&hooks_hash_once, hooks_hash_init);
+
+    const uint8_t index = hooks_hash[hook_hash(name, hooks_hash_seed)];
+    if (!index || !(hooks_map[index - 1].api & api) || strcmp(name, hooks_map[index - 1].name) != 0) {
+        return NULL;
+    }
+    return hooks_map[index - 1].func;
+}
+
+void *obs_vkcapture_eglGetProcAddress(const char *name)
+{
+    return gl_hook_lookup(name, HOOK_EGL);
+}
+
+void *obs_vkcapture_glXGetProcAddress(const char *name)
+{
+    return gl_hook_lookup(name, HOOK_GLX);
+}
+
+void *obs_vkcapture_dlsym(const char *name)
+{
+    return gl_hook_lookup(name, HOOK_EGL | HOOK_GLX);
+}
+
+
+/* ======================================================================== */
+
 void *eglGetProcAddress(const char *procName)
 {
     if (!gl_init_funcs(/*glx*/false)) {
         return NULL;
     }
+    // Hooks are only returned for functions the driver has
+    void *real = egl_f.GetProcAddress(procName);
     void *func = obs_vkcapture_eglGetProcAddress(procName);
-    return func ? func : egl_f.GetProcAddress(procName);
+    return func && real ? func : real;
 }
 
 unsigned eglDestroyContext(void *display, void *context)
@@ -1035,7 +1810,9 @@ unsigned eglDestroyContext(void *display, void *context)
         return 0;
     }
 
-    gl_free();
+    if (context == data.context) {
+        gl_free();
+    }
 
     return egl_f.DestroyContext(display, context);
 }
@@ -1047,12 +1824,38 @@ unsigned eglSwapBuffers(void *display, void *surface)
     }
 
     if (data.valid) {
-        gl_capture(display, surface);
+        gl_capture(display, surface, NULL, 0);
     }
 
     return egl_f.SwapBuffers(display, surface);
 }
 
+unsigned eglSwapBuffersWithDamageKHR(void *display, void *surface, const int *rects, int n_rects)
+{
+    if (!gl_init_funcs(/*glx*/false) || !egl_f.SwapBuffersWithDamageKHR) {
+        return 0;
+    }
+
+    if (data.valid) {
+        gl_capture(display, surface, rects, n_rects);
+    }
+
+    return egl_f.SwapBuffersWithDamageKHR(display, surface, rects, n_rects);
+}
+
+unsigned eglSwapBuffersWithDamageEXT(void *display, void *surface, const int *rects, int n_rects)
+{
+    if (!gl_init_funcs(/*glx*/false) || !egl_f.SwapBuffersWithDamageEXT) {
+        return 0;
+    }
+
+    if (data.valid) {
+        gl_capture(display, surface, rects, n_rects);
+    }
+
+    return egl_f.SwapBuffersWithDamageEXT(display, surface, rects, n_rects);
+}
+
 void *eglCreateWindowSurface(void *display, void *config, void *win, const intptr_t *attrib_list)
 {
     if (!gl_init_funcs(/*glx*/false)) {
@@ -1061,50 +1864,100 @@ void *eglCreateWindowSurface(void *display, void *config, void *win, const intpt
 
     void *res = egl_f.CreateWindowSurface(display, config, win, attrib_list);
     if (res) {
-        data.winid = (uintptr_t)win;
+        gl_surface_created(display, res, win);
     }
 
     return res;
 }
 
-/* ======================================================================== */
+unsigned eglDestroySurface(void *display, void *surface)
+{
+    if (!gl_init_funcs(/*glx*/false)) {
+        return 0;
+    }
 
-void *glXGetProcAddress(const char *procName);
-void *glXGetProcAddressARB(const char *procName);
-void glXDestroyContext(void *display, void *context);
-void glXSwapBuffers(void *display, void *surface);
-int64_t glXSwapBuffersMscOML(void *display, void *drawable, int64_t target_msc, int64_t divisor, int64_t remainder);
+    gl_surface_destroyed(display, surface);
 
-static struct {
-    void *func;
-    const char *name;
-} glx_hooks_map[] = {
-#define ADD_HOOK(fn) { (void*)fn, #fn }
-    ADD_HOOK(glXGetProcAddress),
-    ADD_HOOK(glXGetProcAddressARB),
-    ADD_HOOK(glXSwapBuffers),
-    ADD_HOOK(glXSwapBuffersMscOML),
-    ADD_HOOK(glXDestroyContext)
-#undef ADD_HOOK
-};
+    return egl_f.DestroySurface(display, surface);
+}
 
-void *obs_vkcapture_glXGetProcAddress(const char *name)
+static void *wl_egl_real(const char *name)
 {
-    for (int i = 0; i < sizeof(glx_hooks_map) / sizeof(glx_hooks_map[0]); ++i) {
-        if (strcmp(name, glx_hooks_map[i].name) == 0) {
-            return glx_hooks_map[i].func;
+    void *func = real_dlsym(RTLD_NEXT, name);
+    if (!func) {
+        // App may have loaded it with RTLD_LOCAL
+        void *handle = dlopen("libwayland-egl.so.1", RTLD_LAZY | RTLD_NOLOAD);
+        if (handle) {
+            func = real_dlsym(handle, name);
+            dlclose(handle);
         }
     }
-    return NULL;
+    if (!func) {
+        hlog("Failed to resolve %s", name);
+    }
+    return func;
 }
 
+void *wl_egl_window_create(void *surface, int width, int height)
+{
+    static void *(*real)(void *surface, int width, int height);
+    if (!real) {
+        real = (typeof(real))wl_egl_real("wl_egl_window_create");
+    }
+    if (!real) {
+        return NULL;
+    }
+
+    void *window = real(surface, width, height);
+    if (window) {
+        pthread_mutex_lock(&gl_surface_mutex);
+        for (int i = 0; i < GL_SURFACE_MAX; ++i) {
+            if (!gl_wl_windows[i]) {
+                gl_wl_windows[i] = window;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&gl_surface_mutex);
+    }
+
+    return window;
+}
+
+void wl_egl_window_destroy(void *window)
+{
+    static void (*real)(void *window);
+    if (!real) {
+        real = (typeof(real))wl_egl_real("wl_egl_window_destroy");
+    }
+
+    pthread_mutex_lock(&gl_surface_mutex);
+    for (int i = 0; i < GL_SURFACE_MAX; ++i) {
+        if (gl_wl_windows[i] == window) {
+            gl_wl_windows[i] = NULL;
+        }
+        if (gl_surfaces[i].wl_window == window) {
+            gl_surfaces[i].wl_window = NULL;
+            gl_surfaces[i].size_valid = false;
+        }
+    }
+    pthread_mutex_unlock(&gl_surface_mutex);
+
+    if (real) {
+        real(window);
+    }
+}
+
+/* ======================================================================== */
+
 void *glXGetProcAddress(const char *procName)
 {
     if (!gl_init_funcs(/*glx*/true)) {
         return NULL;
     }
+    // Hooks are only returned for functions the driver has
+    void *real = glx_f.GetProcAddress(procName);
     void *func = obs_vkcapture_glXGetProcAddress(procName);
-    return func ? func : glx_f.GetProcAddress(procName);
+    return func && real ? func : real;
 }
 
 void *glXGetProcAddressARB(const char *procName)
@@ -1112,8 +1965,9 @@ void *glXGetProcAddressARB(const char *procName)
     if (!gl_init_funcs(/*glx*/true)) {
         return NULL;
     }
+    void *real = glx_f.GetProcAddressARB(procName);
     void *func = obs_vkcapture_glXGetProcAddress(procName);
-    return func ? func : glx_f.GetProcAddressARB(procName);
+    return func && real ? func : real;
 }
 
 void glXDestroyContext(void *display, void *context)
@@ -1122,7 +1976,9 @@ void glXDestroyContext(void *display, void *context)
         return;
     }
 
-    gl_free();
+    if (context == data.context) {
+        gl_free();
+    }
 
     glx_f.DestroyContext(display, context);
 }
@@ -1134,7 +1990,7 @@ void glXSwapBuffers(void *display, void *drawable)
     }
 
     if (data.valid) {
-        gl_capture(display, drawable);
+        gl_capture(display, drawable, NULL, 0);
     }
 
     glx_f.SwapBuffers(display, drawable);
@@ -1147,7 +2003,7 @@ int64_t glXSwapBuffersMscOML(void *display, void *drawable, int64_t target_msc,
     }
 
     if (data.valid) {
-        gl_capture(display, drawable);
+        gl_capture(display, drawable, NULL, 0);
     }
 
     return glx_f.SwapBuffersMscOML(display, drawable, target_msc, divisor, remainder);
@@ -42,8 +42,21 @@ struct gl_funcs {
     PFNGLREADBUFFERPROC ReadBuffer;
     PFNGLDRAWBUFFERPROC DrawBuffer;
     PFNGLBLITFRAMEBUFFERPROC BlitFramebuffer;
+    PFNGLFLUSHPROC Flush;
+    PFNGLGENBUFFERSPROC GenBuffers;
+    PFNGLDELETEBUFFERSPROC DeleteBuffers;
+    PFNGLBINDBUFFERPROC BindBuffer;
+    PFNGLBUFFERDATAPROC BufferData;
+    PFNGLMAPBUFFERRANGEPROC MapBufferRange;
+    PFNGLUNMAPBUFFERPROC UnmapBuffer;
+    PFNGLREADPIXELSPROC ReadPixels;
+    PFNGLPIXELSTOREIPROC PixelStorei;
+    PFNGLFENCESYNCPROC FenceSync;
+    PFNGLCLIENTWAITSYNCPROC ClientWaitSync;
+    PFNGLDELETESYNCPROC DeleteSync;
     PFNGLGETERRORPROC GetError;
     PFNGLGETSTRINGPROC GetString;
+    PFNGLGETSTRINGIPROC GetStringi;
     PFNGLGETUNSIGNEDBYTEI_VEXTPROC GetUnsignedBytei_vEXT;
     PFNGLCREATEMEMORYOBJECTSEXTPROC CreateMemoryObjectsEXT;
     PFNGLMEMORYOBJECTPARAMETERIVEXTPROC MemoryObjectParameterivEXT;
@@ -55,18 +68,27 @@ struct gl_funcs {
 #define P_EGL_HEIGHT 0x3056
 #define P_EGL_WIDTH 0x3057
 #define P_EGL_GL_TEXTURE_2D 0x30B1
+#define P_EGL_EXTENSIONS 0x3055
+#define P_EGL_SYNC_NATIVE_FENCE_ANDROID 0x3144
 
 struct egl_funcs {
     void *(*GetProcAddress)(const char*);
     unsigned (*DestroyContext)(void *display, void *context);
     void *(*GetCurrentContext)();
+    unsigned (*DestroySurface)(void *display, void *surface);
     void *(*CreateWindowSurface)(void *display, void *config, void *win, const intptr_t *attrib_list);
     void *(*CreateImage)(void *display, void *context, unsigned target, intptr_t buffer, const intptr_t *attrib_list);
     unsigned (*DestroyImage)(void *display, void *image);
     unsigned (*QuerySurface)(void *display, void *surface, int attribute, int *value);
     unsigned (*SwapBuffers)(void *display, void *surface);
+    unsigned (*SwapBuffersWithDamageKHR)(void *display, void *surface, const int *rects, int n_rects);
+    unsigned (*SwapBuffersWithDamageEXT)(void *display, void *surface, const int *rects, int n_rects);
     unsigned (*ExportDMABUFImageQueryMESA)(void *dpy, void *image, int *fourcc, int *num_planes, uint64_t *modifiers);
     unsigned (*ExportDMABUFImageMESA)(void *dpy, void *image, int *fds, int *strides, int *offsets);
+    const char *(*QueryString)(void *display, int name);
+    void *(*CreateSyncKHR)(void *display, unsigned type, const int *attrib_list);
+    unsigned (*DestroySyncKHR)(void *display, void *sync);
+    int (*DupNativeFenceFDANDROID)(void *display, void *sync);
 
     bool valid;
 };
@@ -94,6 +116,7 @@ struct glx_funcs {
     void *(*GetProcAddress)(const char*);
     void *(*GetProcAddressARB)(const char*);
     void (*DestroyContext)(void *display, void *context);
+    void *(*GetCurrentContext)();
     void (*SwapBuffers)(void *display, void *drawable);
     int64_t (*SwapBuffersMscOML)(void *display, void *drawable, int64_t target_msc, int64_t divisor, int64_t remainder);
     void *(*CreatePixmap)(void *display, void *config, unsigned long pixmap, const int *attribList);
@@ -189,6 +212,72 @@ struct x11_funcs {
     bool valid;
 };
 
+#define P_XCB_DESTROY_NOTIFY 17
+#define P_XCB_CONFIGURE_NOTIFY 22
+#define P_XCB_CW_EVENT_MASK 2048
+#define P_XCB_EVENT_MASK_STRUCTURE_NOTIFY 131072
+
+typedef struct {
+    uint8_t response_type;
+    uint8_t error_code;
+    uint16_t sequence;
+    uint32_t resource_id;
+} P_xcb_generic_error_t;
+
+typedef struct {
+    uint8_t response_type;
+    uint8_t pad0;
+    uint16_t sequence;
+    uint32_t event;
+    uint32_t window;
+} P_xcb_destroy_notify_event_t;
+
+typedef struct {
+    uint8_t response_type;
+    uint8_t pad0;
+    uint16_t sequence;
+    uint32_t event;
+    uint32_t window;
+    uint32_t above_sibling;
+    int16_t x;
+    int16_t y;
+    uint16_t width;
+    uint16_t height;
+    uint16_t border_width;
+    uint8_t override_redirect;
+    uint8_t pad1;
+} P_xcb_configure_notify_event_t;
+
+typedef struct {
+    unsigned int sequence;
+} P_xcb_void_cookie_t;
+
+struct xcb_funcs {
+    void *(*xcb_connect)(const char *displayname, int *screenp);
+    int (*xcb_connection_has_error)(void *c);
+    void (*xcb_disconnect)(void *c);
+    P_xcb_void_cookie_t (*xcb_change_window_attributes)(void *c, uint32_t window, uint32_t value_mask, const void *value_list);
+    int (*xcb_flush)(void *c);
+    void *(*xcb_poll_for_event)(void *c);
+
+    bool valid;
+};
+
+/* Start of struct wl_egl_window from wayland-egl-backend.h, versions before
+ * 1 started with the wl_surface pointer instead */
+#define P_WL_EGL_WINDOW_VERSION_MIN 1
+#define P_WL_EGL_WINDOW_VERSION_MAX 3
+
+struct P_wl_egl_window {
+    const intptr_t version;
+    int width;
+    int height;
+    int dx;
+    int dy;
+    int attached_width;
+    int attached_height;
+};
+
 struct vk_funcs {
     PFN_vkGetInstanceProcAddr GetInstanceProcAddr;
     PFN_vkGetDeviceProcAddr GetDeviceProcAddr;
@@ -25,6 +25,13 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include <stdlib.h>
 #include <time.h>
 
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
 static inline int os_dupfd_cloexec(int fd)
 {
     return fcntl(fd, F_DUPFD_CLOEXEC, 3);
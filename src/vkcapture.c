@@ -20,17 +20,27 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 
 #include <obs-module.h>
 #include <obs-nix-platform.h>
+#include <util/dstr.h>
+#include <util/platform.h>
+#include <util/threading.h>
 
 #include <poll.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <stddef.h>
 #include <inttypes.h>
 #include <sys/un.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/ioctl.h>
 #include <linux/dma-buf.h>
 
@@ -40,7 +50,6 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 
 #if HAVE_X11_XCB
 #include "xcursor-xcb.h"
-static xcb_connection_t *xcb = NULL;
 #endif
 
 #if HAVE_WAYLAND
@@ -50,8 +59,14 @@ static wl_cursor_t *wlcursor = NULL;
 #endif
 
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 static uint8_t gl_device_uuid[16];
+static uint8_t gl_driver_uuid[16];
 void (*p_glGetUnsignedBytei_vEXT)(unsigned int target, unsigned int index, unsigned char *data) = NULL;
+static bool dmabuf_modifiers_queried = false;
+static DARRAY(struct capture_modifier_data) dmabuf_modifiers;
+static obs_data_t *import_cache = NULL;
+static char *import_cache_path = NULL;
 
 enum vkcapture_import_attempt {
     IMPORT_DEFAULT = 0,
@@ -61,38 +76,203 @@ enum vkcapture_import_attempt {
     IMPORT_FAILURES_MAX = IMPORT_LINEAR_HOST_MAPPED,
 };
 
-typedef struct {
+// Host mapped upload cost is weighted as if it was done for one second
+#define IMPORT_SAMPLE_FRAMES 60
+
+// Immutable once published, except timestamps which the server keeps updating.
+// Only freed on graphics thread after it was retired and refs dropped to zero.
+typedef struct vkcapture_buffer {
+    atomic_int refs;
+    int seq;
+    int nslots;
+    int fds[CAPTURE_MAX_SLOTS][4];
+    _Atomic uint64_t timestamps[CAPTURE_MAX_SLOTS];
+    atomic_int fences[CAPTURE_MAX_SLOTS];
+    atomic_uint damage_rows[CAPTURE_MAX_SLOTS]; // Not uploaded yet, see damage_rows_union
+    struct capture_texture_data tdata[CAPTURE_MAX_SLOTS];
+    struct vkcapture_buffer *next;
+} vkcapture_buffer_t;
+
+enum server_watch_type {
+    SERVER_WATCH_EVENT,
+    SERVER_WATCH_LISTEN,
+    SERVER_WATCH_CLIENT,
+    SERVER_WATCH_CLIENT_PID,
+};
+
+struct server_watch {
+    enum server_watch_type type;
+    struct vkcapture_client *client;
+};
+
+// Counters exported by vkcapture_metrics proc handler
+struct client_metrics {
+    _Atomic int64_t frames;
+    _Atomic int64_t buffers;
+    _Atomic int64_t fds;
+    _Atomic int64_t import_attempts;
+    _Atomic int64_t import_failures;
+    _Atomic int64_t import_tier;
+    _Atomic int64_t import_latency_ns;
+    _Atomic int64_t handshake_latency_ns;
+};
+
+struct source_metrics {
+    _Atomic int64_t client_id;
+    _Atomic int64_t connects;
+    _Atomic int64_t timeouts;
+    _Atomic int64_t imports;
+    _Atomic int64_t frame_age_ns;
+};
+
+struct metric_desc {
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t offset;
+};
+
+#define CLIENT_METRIC(name, type, help) {#name, type, help, offsetof(struct client_metrics, name)}
+#define SOURCE_METRIC(name, type, help) {#name, type, help, offsetof(struct source_metrics, name)}
+
+static const struct metric_desc client_metric_descs[] = {
+    CLIENT_METRIC(frames, "counter", "Frame messages received"),
+    CLIENT_METRIC(buffers, "counter", "Texture buffers received"),
+    CLIENT_METRIC(fds, "counter", "Dmabuf file descriptors received"),
+    CLIENT_METRIC(import_attempts, "counter", "Texture imports"),
+    CLIENT_METRIC(import_failures, "counter", "Failed texture imports"),
+    CLIENT_METRIC(import_tier, "gauge", "Texture import tier of last import"),
+    CLIENT_METRIC(import_latency_ns, "gauge", "Duration of last texture import in nanoseconds"),
+    CLIENT_METRIC(handshake_latency_ns, "gauge", "Duration of last capture handshake in nanoseconds"),
+};
+
+static const struct metric_desc source_metric_descs[] = {
+    SOURCE_METRIC(client_id, "gauge", "Id of captured client, 0 if none"),
+    SOURCE_METRIC(connects, "counter", "Clients attached to the source"),
+    SOURCE_METRIC(timeouts, "counter", "Clients dropped for not responding"),
+    SOURCE_METRIC(imports, "counter", "Texture buffers imported"),
+    SOURCE_METRIC(frame_age_ns, "gauge", "Age of the rendered frame in nanoseconds"),
+};
+
+#define CLIENT_TIMEOUT_MIN 2000000000LL
+#define CLIENT_TIMEOUT_MAX 5000000000LL
+
+typedef struct vkcapture_client {
     int id;
     int sockfd;
+    int pidfd;
+    struct server_watch watch;
+    struct server_watch pid_watch;
     int activated;
-    int buf_id;
-    int buf_fds[4];
+    uint8_t capturing;
+    _Atomic(vkcapture_buffer_t *) buffer;
+    vkcapture_buffer_t *current; // server thread only
+    vkcapture_buffer_t *pending; // server thread only
+    int buffer_seq; // server thread only
+    int result_seq;
     int import_failures;
-    size_t map_size;
-    void *map_memory;
+    bool strategy_loaded;
+    bool calibrating;
+    int64_t import_costs[IMPORT_FAILURES_MAX + 1];
+    uint64_t import_modifiers[IMPORT_FAILURES_MAX + 1];
+    int cached_tier;
+    uint32_t cached_format;
+    uint64_t cached_modifier;
     uint64_t timeout;
+    int64_t handshake_start;
+    int64_t handshake_ns;
     bool unresponsive;
+    bool closed;
+    bool modifiers_sent;
+    uint8_t held; // Slots sent in release data
     struct capture_client_data cdata;
-    struct capture_texture_data tdata;
+    struct client_metrics metrics;
 } vkcapture_client_t;
 
+#define SERVER_MAX_EVENTS 64
+
 static struct {
     bool quit;
     int eventfd;
+    int epollfd;
+    int sockfd;
+    int clientid;
+    struct server_watch event_watch;
+    struct server_watch listen_watch;
     pthread_t thread;
     pthread_mutex_t mutex;
-    DARRAY(struct pollfd) fds;
-    DARRAY(vkcapture_client_t) clients;
+    DARRAY(vkcapture_client_t *) clients;
+    _Atomic(vkcapture_buffer_t *) retired;
 } server;
 
 static int source_instances = 0;
 
+// Imported textures, shared by all sources capturing the same client.
+// Keyed by dmabuf identity and layout, so re-sent buffers are not imported again.
+typedef struct vkcapture_texture {
+    int client_id;
+    dev_t dev;
+    ino_t ino;
+    int32_t width;
+    int32_t height;
+    int32_t format;
+    uint8_t nfd;
+    int32_t strides[4];
+    int32_t offsets[4];
+    uint64_t modifier;
+    bool map_host;
+    bool uploader;
+    gs_texture_t *texture;
+    int refs;
+    uint64_t last_used;
+
+    // Host mapped frames are copied by upload thread into the mapped pixel
+    // buffer of a second texture, which is swapped in once the copy is done.
+    // Host memory slots after the first are only mapped, the first one
+    // uploads from all of them.
+    int map_fd;
+    size_t map_size;
+    void *map_memory;
+    int64_t upload_ns;
+    gs_texture_t *upload_texture;
+    pthread_t upload_thread;
+    os_sem_t *upload_sem;
+    bool upload_busy;
+    bool upload_quit;
+    atomic_bool upload_done;
+    struct vkcapture_texture *upload_src;
+    uint8_t *upload_data;
+    uint32_t upload_linesize;
+    uint64_t upload_timestamp;
+    uint32_t upload_rows;
+    uint32_t upload_rows_prev;
+} vkcapture_texture_t;
+
+#define TEXTURE_CACHE_UNUSED_MAX CAPTURE_MAX_SLOTS
+
+static struct {
+    pthread_mutex_t mutex;
+    uint64_t use_count;
+    DARRAY(vkcapture_texture_t *) textures;
+} texture_cache;
+
+// Textures of one client buffer with the cost of importing them
+typedef struct {
+    vkcapture_buffer_t *buffer;
+    int client_id;
+    int tier;
+    bool imported;
+    int64_t cost;
+    vkcapture_texture_t *textures[CAPTURE_MAX_SLOTS];
+} vkcapture_import_t;
+
 typedef struct {
     obs_source_t *source;
     gs_texture_t *texture;
+    vkcapture_texture_t *textures[CAPTURE_MAX_SLOTS];
+    int nslots;
 #if HAVE_X11_XCB
     xcb_xcursor_t *xcursor;
-    uint32_t root_winid;
 #endif
     bool show_cursor;
     bool allow_transparency;
@@ -100,13 +280,27 @@ typedef struct {
     bool window_match;
     bool window_exclude;
     const char *window;
+    bool snapshot;
+    int snapshot_interval;
+    struct capture_region region;
+    int frame_delay;
 
-    int buf_id;
+    vkcapture_buffer_t *buffer;
+    int slot;
     int client_id;
+    struct capture_region client_region;
+    struct capture_region view;
+    bool client_snapshot;
+    bool client_paused;
+    bool client_pacing;
+    int64_t next_snapshot;
+    atomic_bool snapshot_requested;
     struct capture_texture_data tdata;
-
+    struct source_metrics metrics;
 } vkcapture_source_t;
 
+static DARRAY(vkcapture_source_t *) sources;
+
 static bool server_wakeup();
 
 static const char *import_attempt_str(enum vkcapture_import_attempt attempt)
@@ -155,6 +349,34 @@ static enum gs_color_format drm_format_to_gs(int32_t drm)
     return GS_UNKNOWN;
 }
 
+static void query_dmabuf_modifiers()
+{
+    dmabuf_modifiers_queried = true;
+
+#if LIBOBS_API_MAJOR_VER >= 28
+    obs_enter_graphics();
+    for (size_t i = 0; i < sizeof(gs_format_table) / sizeof(gs_format_table[0]); ++i) {
+        uint64_t *modifiers = NULL;
+        size_t n_modifiers = 0;
+        if (!gs_query_dmabuf_modifiers_for_format(gs_format_table[i].drm, &modifiers, &n_modifiers)) {
+            continue;
+        }
+        for (size_t j = 0; j < n_modifiers; j += CAPTURE_MODIFIER_DATA_MAX) {
+            struct capture_modifier_data md = {0};
+            md.type = CAPTURE_MODIFIER_DATA_TYPE;
+            md.format = gs_format_table[i].drm;
+            md.count = MIN(n_modifiers - j, CAPTURE_MODIFIER_DATA_MAX);
+            memcpy(md.modifiers, modifiers + j, md.count * sizeof(uint64_t));
+            da_push_back(dmabuf_modifiers, &md);
+        }
+        bfree(modifiers);
+    }
+    obs_leave_graphics();
+#endif
+
+    blog(LOG_INFO, "Importable dmabuf modifiers: %zu chunks", dmabuf_modifiers.num);
+}
+
 static void cursor_create(vkcapture_source_t *ctx)
 {
     bool try_xcb = false;
@@ -177,15 +399,7 @@ static void cursor_create(vkcapture_source_t *ctx)
 #endif
 #if HAVE_X11_XCB
     if (try_xcb || obs_get_nix_platform() == OBS_NIX_PLATFORM_X11_EGL) {
-        if (!xcb) {
-            xcb = xcb_connect(NULL, NULL);
-            if (!xcb || xcb_connection_has_error(xcb)) {
-                blog(LOG_ERROR, "Unable to open X display!");
-            }
-        }
-        if (xcb) {
-            ctx->xcursor = xcb_xcursor_init(xcb);
-        }
+        ctx->xcursor = xcb_xcursor_init();
     }
 #endif
 }
@@ -198,18 +412,14 @@ static void cursor_destroy(vkcapture_source_t *ctx)
         xcb_xcursor_destroy(ctx->xcursor);
         obs_leave_graphics();
     }
-    if (!source_instances) {
-        if (xcb) {
-            xcb_disconnect(xcb);
-            xcb = NULL;
-        }
-    }
 #endif
 #if HAVE_WAYLAND
     if (!source_instances) {
         blog(LOG_INFO, "destroy");
         if (wlcursor) {
+            obs_enter_graphics();
             wl_cursor_destroy(wlcursor);
+            obs_leave_graphics();
             wlcursor = NULL;
         }
         if (wl_display) {
@@ -239,40 +449,9 @@ static void cursor_update(vkcapture_source_t *ctx)
 {
 #if HAVE_X11_XCB
     if (ctx->xcursor) {
-        if (!ctx->root_winid && ctx->tdata.winid) {
-            xcb_query_tree_cookie_t tre_c = xcb_query_tree_unchecked(xcb, ctx->tdata.winid);
-            xcb_query_tree_reply_t *tre_r = xcb_query_tree_reply(xcb, tre_c, NULL);
-            if (tre_r) {
-                ctx->root_winid = tre_r->root;
-                free(tre_r);
-            }
-        }
-        xcb_translate_coordinates_cookie_t tr_c;
-        if (ctx->root_winid && ctx->tdata.winid) {
-            tr_c = xcb_translate_coordinates_unchecked(xcb, ctx->tdata.winid, ctx->root_winid, 0, 0);
-        }
-        xcb_xfixes_get_cursor_image_cookie_t cur_c = xcb_xfixes_get_cursor_image_unchecked(xcb);
-        xcb_xfixes_get_cursor_image_reply_t *cur_r = xcb_xfixes_get_cursor_image_reply(xcb, cur_c, NULL);
-        if (ctx->root_winid && ctx->tdata.winid) {
-            xcb_translate_coordinates_reply_t *tr_r = xcb_translate_coordinates_reply(xcb, tr_c, NULL);
-            if (tr_r) {
-                xcb_xcursor_offset(ctx->xcursor, tr_r->dst_x, tr_r->dst_y);
-                free(tr_r);
-            }
-        }
-        xcb_xcursor_update(ctx->xcursor, cur_r);
-        free(cur_r);
-    }
-#endif
-#if HAVE_WAYLAND
-    if (wlcursor) {
-        struct pollfd fd;
-        fd.fd = wl_display_get_fd(wl_display);
-        fd.events = POLLIN;
-        if (poll(&fd, 1, 0) > 0) {
-            wl_display_dispatch(wl_display);
-        }
-        wl_display_flush(wl_display);
+        xcb_xcursor_offset(ctx->xcursor, ctx->tdata.crop_x + ctx->view.x,
+            ctx->tdata.crop_y + ctx->view.y);
+        xcb_xcursor_update(ctx->xcursor, ctx->tdata.winid);
     }
 #endif
 }
@@ -291,18 +470,489 @@ static void cursor_render(vkcapture_source_t *ctx)
 #endif
 }
 
-static void destroy_texture(vkcapture_source_t *ctx)
+static vkcapture_buffer_t *buffer_create()
 {
-    if (!ctx->texture) {
+    vkcapture_buffer_t *buf = bzalloc(sizeof(vkcapture_buffer_t));
+    memset(buf->fds, -1, sizeof(buf->fds));
+    for (int slot = 0; slot < CAPTURE_MAX_SLOTS; ++slot) {
+        atomic_init(&buf->fences[slot], -1);
+    }
+    return buf;
+}
+
+static void buffer_free(vkcapture_buffer_t *buf)
+{
+    for (int slot = 0; slot < CAPTURE_MAX_SLOTS; ++slot) {
+        for (int i = 0; i < 4; ++i) {
+            if (buf->fds[slot][i] >= 0) {
+                close(buf->fds[slot][i]);
+            }
+        }
+        const int fence = atomic_load(&buf->fences[slot]);
+        if (fence >= 0) {
+            close(fence);
+        }
+    }
+    bfree(buf);
+}
+
+static void buffer_release(vkcapture_buffer_t *buf)
+{
+    if (buf) {
+        atomic_fetch_sub(&buf->refs, 1);
+    }
+}
+
+// Called by whoever takes the buffer out of client->buffer
+static void buffer_retire(vkcapture_buffer_t *buf)
+{
+    if (!buf) {
         return;
     }
+    buffer_release(buf);
+    buf->next = atomic_load(&server.retired);
+    while (!atomic_compare_exchange_weak(&server.retired, &buf->next, buf));
+}
+
+// Graphics thread only, which is also the only one taking new references
+static void buffers_collect()
+{
+    vkcapture_buffer_t *buf = atomic_exchange(&server.retired, NULL);
+    while (buf) {
+        vkcapture_buffer_t *next = buf->next;
+        if (atomic_load(&buf->refs)) {
+            buf->next = atomic_load(&server.retired);
+            while (!atomic_compare_exchange_weak(&server.retired, &buf->next, buf));
+        } else {
+            buffer_free(buf);
+        }
+        buf = next;
+    }
+}
+
+static void texture_upload_mapped(vkcapture_texture_t *t, const vkcapture_texture_t *src)
+{
+    struct dma_buf_sync sync;
+    sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+    ioctl(src->map_fd, DMA_BUF_IOCTL_SYNC, &sync);
 
     obs_enter_graphics();
-    gs_texture_destroy(ctx->texture);
+    gs_texture_set_image(t->texture, src->map_memory, t->strides[0], false);
     obs_leave_graphics();
+
+    sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+    ioctl(src->map_fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+// Damaged rows are packed as first << 16 | end, 0 = none
+#define DAMAGE_ROWS_ALL UINT16_MAX
+
+static uint32_t damage_rows_union(uint32_t a, uint32_t b)
+{
+    if (!a || !b) {
+        return a | b;
+    }
+    return MIN(a >> 16, b >> 16) << 16 | MAX(a & 0xffff, b & 0xffff);
+}
+
+static void damage_rows_add(atomic_uint *rows, uint32_t first, uint32_t end)
+{
+    if (end <= first) {
+        return;
+    }
+    unsigned old = atomic_load(rows);
+    while (!atomic_compare_exchange_weak(rows, &old, damage_rows_union(old, first << 16 | end))) {
+    }
+}
+
+static void *texture_upload_thread_run(void *data)
+{
+    vkcapture_texture_t *t = data;
+
+    while (os_sem_wait(t->upload_sem) == 0 && !t->upload_quit) {
+        const uint32_t stride = t->strides[0];
+        const uint32_t size = MIN(stride, t->upload_linesize);
+        const vkcapture_texture_t *u = t->upload_src;
+        const uint8_t *src = u->map_memory;
+        // Rows outside damage keep what the pixel buffer had, unmapping uploads all of it
+        const int first = t->upload_rows >> 16;
+        const int end = MIN(t->upload_rows & 0xffff, (uint32_t)t->height);
+
+        struct dma_buf_sync sync;
+        sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+        ioctl(u->map_fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+        for (int y = first; y < end; ++y) {
+            memcpy(t->upload_data + y * t->upload_linesize, src + y * stride, size);
+        }
+
+        sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+        ioctl(u->map_fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+        atomic_store(&t->upload_done, true);
+    }
+
+    return NULL;
+}
+
+static void texture_upload_start(vkcapture_texture_t *t, uint64_t timestamp)
+{
+    obs_enter_graphics();
+    t->upload_texture = gs_texture_create(t->width, t->height,
+        drm_format_to_gs(t->format), 1, NULL, GS_DYNAMIC);
+    obs_leave_graphics();
+    if (!t->upload_texture) {
+        return;
+    }
+
+    if (os_sem_init(&t->upload_sem, 0) != 0
+        || pthread_create(&t->upload_thread, NULL, texture_upload_thread_run, t) != 0) {
+        blog(LOG_WARNING, "Failed to create upload thread");
+        if (t->upload_sem) {
+            os_sem_destroy(t->upload_sem);
+            t->upload_sem = NULL;
+        }
+        obs_enter_graphics();
+        gs_texture_destroy(t->upload_texture);
+        obs_leave_graphics();
+        t->upload_texture = NULL;
+        return;
+    }
+    pthread_setname_np(t->upload_thread, "vkcapture-upld");
+
+    // First frame was uploaded during import, second texture has nothing yet
+    t->upload_src = t;
+    t->upload_timestamp = timestamp;
+    t->upload_rows_prev = DAMAGE_ROWS_ALL;
+}
+
+static void texture_upload_stop(vkcapture_texture_t *t)
+{
+    if (!t->upload_texture) {
+        return;
+    }
+
+    t->upload_quit = true;
+    os_sem_post(t->upload_sem);
+    pthread_join(t->upload_thread, NULL);
+    os_sem_destroy(t->upload_sem);
+    t->upload_sem = NULL;
+
+    obs_enter_graphics();
+    if (t->upload_busy) {
+        gs_texture_unmap(t->upload_texture);
+        t->upload_busy = false;
+    }
+    gs_texture_destroy(t->upload_texture);
+    obs_leave_graphics();
+    t->upload_texture = NULL;
+}
+
+// Called from video tick of every source using the texture, src is the
+// texture of the slot to upload from
+static void texture_upload_update(vkcapture_texture_t *t, vkcapture_texture_t *src,
+        uint64_t timestamp, atomic_uint *damage_rows)
+{
+    if (t->upload_busy) {
+        if (!atomic_load(&t->upload_done)) {
+            return;
+        }
+        obs_enter_graphics();
+        gs_texture_unmap(t->upload_texture);
+        obs_leave_graphics();
+        gs_texture_t *texture = t->texture;
+        t->texture = t->upload_texture;
+        t->upload_texture = texture;
+        t->upload_busy = false;
+    }
+
+    // Without frame messages every tick may have a new frame
+    if (timestamp && timestamp == t->upload_timestamp && src == t->upload_src) {
+        return;
+    }
+
+    // Frame didn't change anything
+    if (timestamp && !atomic_load(damage_rows) && src == t->upload_src) {
+        t->upload_timestamp = timestamp;
+        return;
+    }
+
+    obs_enter_graphics();
+    const bool mapped = gs_texture_map(t->upload_texture, &t->upload_data, &t->upload_linesize);
+    obs_leave_graphics();
+    if (!mapped) {
+        return;
+    }
+
+    // Upload texture has the frame before the previous upload, so it misses
+    // the rows of that upload as well. Damage is tracked per slot, another
+    // slot may differ everywhere.
+    uint32_t rows = timestamp ? atomic_exchange(damage_rows, 0) : DAMAGE_ROWS_ALL;
+    if (src != t->upload_src) {
+        rows = DAMAGE_ROWS_ALL;
+    }
+    t->upload_src = src;
+    t->upload_rows = damage_rows_union(rows, t->upload_rows_prev);
+    t->upload_rows_prev = rows;
+    t->upload_timestamp = timestamp;
+    t->upload_busy = true;
+    atomic_store(&t->upload_done, false);
+    os_sem_post(t->upload_sem);
+}
+
+static void texture_destroy(vkcapture_texture_t *t)
+{
+    texture_upload_stop(t);
+
+    if (t->texture) {
+        obs_enter_graphics();
+        gs_texture_destroy(t->texture);
+        obs_leave_graphics();
+    }
+    if (t->map_memory) {
+        munmap(t->map_memory, t->map_size);
+    }
+    if (t->map_fd >= 0) {
+        close(t->map_fd);
+    }
+    bfree(t);
+}
+
+static bool texture_import(vkcapture_texture_t *t, int *fds, uint64_t timestamp)
+{
+    if (t->map_host) {
+        blog(LOG_INFO, "Creating texture from mapped dmabuf %dx%d", t->width, t->height);
+
+        t->map_fd = fcntl(fds[0], F_DUPFD_CLOEXEC, 0);
+        if (t->map_fd < 0) {
+            blog(LOG_ERROR, "Failed to dup dmabuf '%s'", strerror(errno));
+            return false;
+        }
+        t->map_size = lseek(t->map_fd, 0, SEEK_END);
+        t->map_memory = mmap(NULL, t->map_size, PROT_READ, MAP_SHARED, t->map_fd, 0);
+        if (t->map_memory == MAP_FAILED) {
+            t->map_memory = NULL;
+            blog(LOG_ERROR, "Failed to map dmabuf '%s'", strerror(errno));
+            return false;
+        }
+        // Other slots are only read by the uploader
+        if (!t->uploader) {
+            return true;
+        }
+
+        obs_enter_graphics();
+        t->texture = gs_texture_create(t->width, t->height,
+            drm_format_to_gs(t->format), 1, NULL, GS_DYNAMIC);
+        obs_leave_graphics();
+        if (!t->texture) {
+            return false;
+        }
+
+        const int64_t start = clock_ns();
+        texture_upload_mapped(t, t);
+        t->upload_ns = clock_ns() - start;
+        texture_upload_start(t, timestamp);
+        return true;
+    }
+
+    blog(LOG_INFO, "Creating texture from dmabuf %dx%d modifier:%" PRIu64,
+            t->width, t->height, t->modifier);
+
+    uint32_t strides[4];
+    uint32_t offsets[4];
+    uint64_t modifiers[4];
+    for (uint8_t i = 0; i < t->nfd; ++i) {
+        strides[i] = t->strides[i];
+        offsets[i] = t->offsets[i];
+        modifiers[i] = t->modifier;
+        blog(LOG_INFO, " [%d] fd:%d stride:%d offset:%d", i, fds[i], strides[i], offsets[i]);
+    }
+
+    obs_enter_graphics();
+    t->texture = gs_texture_create_from_dmabuf(t->width, t->height,
+        t->format, drm_format_to_gs(t->format), t->nfd, fds,
+        strides, offsets, t->modifier != DRM_FORMAT_MOD_INVALID ? modifiers : NULL);
+    obs_leave_graphics();
+
+    return t->texture;
+}
+
+static vkcapture_texture_t *texture_cache_import(int client_id, vkcapture_buffer_t *buf, int slot, bool map_host)
+{
+    const struct capture_texture_data *td = &buf->tdata[slot];
+    int *fds = buf->fds[slot];
+
+    struct stat st;
+    if (fstat(fds[0], &st) != 0) {
+        blog(LOG_WARNING, "Failed to stat dmabuf: %s", strerror(errno));
+        memset(&st, 0, sizeof(st));
+    }
+
+    // One uploader per client buffer, for all host mapped slots
+    const bool uploader = map_host && slot == 0;
+
+    pthread_mutex_lock(&texture_cache.mutex);
+
+    vkcapture_texture_t *texture = NULL;
+    for (size_t i = 0; i < texture_cache.textures.num; ++i) {
+        vkcapture_texture_t *t = texture_cache.textures.array[i];
+        if (st.st_ino && t->client_id == client_id && t->dev == st.st_dev && t->ino == st.st_ino
+            && t->map_host == map_host && t->uploader == uploader && t->width == td->width && t->height == td->height
+            && t->format == td->format && t->modifier == td->modifier && t->nfd == td->nfd
+            && !memcmp(t->strides, td->strides, sizeof(t->strides))
+            && !memcmp(t->offsets, td->offsets, sizeof(t->offsets))) {
+            texture = t;
+            break;
+        }
+    }
+
+    if (!texture) {
+        texture = bzalloc(sizeof(vkcapture_texture_t));
+        texture->client_id = client_id;
+        texture->dev = st.st_dev;
+        texture->ino = st.st_ino;
+        texture->width = td->width;
+        texture->height = td->height;
+        texture->format = td->format;
+        texture->nfd = td->nfd;
+        memcpy(texture->strides, td->strides, sizeof(texture->strides));
+        memcpy(texture->offsets, td->offsets, sizeof(texture->offsets));
+        texture->modifier = td->modifier;
+        texture->map_host = map_host;
+        texture->uploader = uploader;
+        texture->map_fd = -1;
+        if (!texture_import(texture, fds, atomic_load(&buf->timestamps[slot]))) {
+            texture_destroy(texture);
+            texture = NULL;
+        } else {
+            da_push_back(texture_cache.textures, &texture);
+        }
+    }
+
+    if (texture) {
+        texture->refs++;
+        texture->last_used = ++texture_cache.use_count;
+    }
+
+    pthread_mutex_unlock(&texture_cache.mutex);
+
+    return texture;
+}
+
+static void texture_cache_release(vkcapture_texture_t *texture)
+{
+    pthread_mutex_lock(&texture_cache.mutex);
+
+    if (--texture->refs == 0) {
+        // Unused host mappings are not worth keeping their upload thread around
+        if (texture->map_host || !texture->ino) {
+            da_erase_item(texture_cache.textures, &texture);
+            texture_destroy(texture);
+            pthread_mutex_unlock(&texture_cache.mutex);
+            return;
+        }
+
+        // Keep few unused textures of the client, least recently used goes first
+        size_t unused = 0;
+        vkcapture_texture_t *oldest = NULL;
+        for (size_t i = 0; i < texture_cache.textures.num; ++i) {
+            vkcapture_texture_t *t = texture_cache.textures.array[i];
+            if (t->refs || t->client_id != texture->client_id) {
+                continue;
+            }
+            unused++;
+            if (!oldest || t->last_used < oldest->last_used) {
+                oldest = t;
+            }
+        }
+        if (unused > TEXTURE_CACHE_UNUSED_MAX) {
+            da_erase_item(texture_cache.textures, &oldest);
+            texture_destroy(oldest);
+        }
+    }
+
+    pthread_mutex_unlock(&texture_cache.mutex);
+}
+
+// Drops unused textures of disconnected clients, or all of them
+static void texture_cache_purge(bool all)
+{
+    pthread_mutex_lock(&server.mutex);
+    pthread_mutex_lock(&texture_cache.mutex);
+
+    for (size_t i = 0; i < texture_cache.textures.num;) {
+        vkcapture_texture_t *t = texture_cache.textures.array[i];
+        bool connected = false;
+        for (size_t j = 0; j < server.clients.num && !all; ++j) {
+            connected |= server.clients.array[j]->id == t->client_id;
+        }
+        if (t->refs || connected) {
+            i++;
+            continue;
+        }
+        da_erase(texture_cache.textures, i);
+        texture_destroy(t);
+    }
+
+    pthread_mutex_unlock(&texture_cache.mutex);
+    pthread_mutex_unlock(&server.mutex);
+}
+
+static void import_release(vkcapture_import_t *job)
+{
+    for (int i = 0; i < CAPTURE_MAX_SLOTS; ++i) {
+        if (job->textures[i]) {
+            texture_cache_release(job->textures[i]);
+        }
+    }
+    buffer_release(job->buffer);
+}
+
+static void import_run(vkcapture_import_t *job)
+{
+    vkcapture_buffer_t *buf = job->buffer;
+
+    int64_t cost = clock_ns();
+    job->imported = buf->nslots > 0;
+    for (int slot = 0; slot < buf->nslots && job->imported; ++slot) {
+        job->textures[slot] = texture_cache_import(job->client_id, buf, slot,
+            job->tier == IMPORT_LINEAR_HOST_MAPPED || buf->tdata[slot].host_memory);
+        job->imported = job->textures[slot];
+    }
+    job->cost = clock_ns() - cost;
+
+    if (job->imported) {
+        // Host mapped frames are copied on every new frame
+        if (job->textures[0]->map_host) {
+            job->cost += job->textures[0]->upload_ns * IMPORT_SAMPLE_FRAMES;
+        }
+    } else {
+        for (int i = 0; i < CAPTURE_MAX_SLOTS; ++i) {
+            if (job->textures[i]) {
+                texture_cache_release(job->textures[i]);
+                job->textures[i] = NULL;
+            }
+        }
+    }
+}
+
+static void destroy_textures(vkcapture_source_t *ctx)
+{
+    for (int i = 0; i < CAPTURE_MAX_SLOTS; ++i) {
+        if (ctx->textures[i]) {
+            texture_cache_release(ctx->textures[i]);
+            ctx->textures[i] = NULL;
+        }
+    }
     ctx->texture = NULL;
+    ctx->nslots = 0;
+}
 
-    ctx->buf_id = 0;
+static void destroy_texture(vkcapture_source_t *ctx)
+{
+    destroy_textures(ctx);
+    buffer_release(ctx->buffer);
+    ctx->buffer = NULL;
     memset(&ctx->tdata, 0, sizeof(ctx->tdata));
 }
 
@@ -312,9 +962,15 @@ static void vkcapture_source_destroy(void *data)
 
     vkcapture_source_t *ctx = data;
 
+    pthread_mutex_lock(&server.mutex);
+    da_erase_item(sources, &ctx);
+    pthread_mutex_unlock(&server.mutex);
+
     destroy_texture(ctx);
     cursor_destroy(ctx);
 
+    texture_cache_purge(source_instances == 0);
+
     bfree(ctx);
 }
 
@@ -325,6 +981,13 @@ static void vkcapture_source_update(void *data, obs_data_t *settings)
     ctx->show_cursor = obs_data_get_bool(settings, "show_cursor");
     ctx->allow_transparency = obs_data_get_bool(settings, "allow_transparency");
     ctx->force_hdr = obs_data_get_bool(settings, "force_hdr");
+    ctx->snapshot = obs_data_get_bool(settings, "snapshot");
+    ctx->snapshot_interval = obs_data_get_int(settings, "snapshot_interval");
+    ctx->region.x = obs_data_get_int(settings, "region_x");
+    ctx->region.y = obs_data_get_int(settings, "region_y");
+    ctx->region.width = obs_data_get_int(settings, "region_width");
+    ctx->region.height = obs_data_get_int(settings, "region_height");
+    ctx->frame_delay = obs_data_get_int(settings, "frame_delay");
 
     ctx->window_match = false;
     ctx->window_exclude = false;
@@ -340,6 +1003,14 @@ static void vkcapture_source_update(void *data, obs_data_t *settings)
     }
 }
 
+static void vkcapture_source_request_frame(void *data, calldata_t *cd)
+{
+    vkcapture_source_t *ctx = data;
+    atomic_store(&ctx->snapshot_requested, true);
+
+    UNUSED_PARAMETER(cd);
+}
+
 static void *vkcapture_source_create(obs_data_t *settings, obs_source_t *source)
 {
     ++source_instances;
@@ -351,6 +1022,13 @@ static void *vkcapture_source_create(obs_data_t *settings, obs_source_t *source)
 
     cursor_create(ctx);
 
+    proc_handler_t *ph = obs_source_get_proc_handler(source);
+    proc_handler_add(ph, "void request_frame()", vkcapture_source_request_frame, ctx);
+
+    pthread_mutex_lock(&server.mutex);
+    da_push_back(sources, &ctx);
+    pthread_mutex_unlock(&server.mutex);
+
     UNUSED_PARAMETER(settings);
     return ctx;
 }
@@ -360,7 +1038,7 @@ static vkcapture_client_t *find_matching_client(vkcapture_source_t *ctx)
     vkcapture_client_t *client = NULL;
     if (ctx->window) {
         for (size_t i = 0; i < server.clients.num; i++) {
-            vkcapture_client_t *c = server.clients.array + i;
+            vkcapture_client_t *c = server.clients.array[i];
             bool match = !strcmp(c->cdata.exe, ctx->window);
             if ((ctx->window_match && match) || (ctx->window_exclude && !match)) {
                 client = c;
@@ -368,7 +1046,7 @@ static vkcapture_client_t *find_matching_client(vkcapture_source_t *ctx)
             }
         }
     } else if (server.clients.num) {
-        client = server.clients.array;
+        client = server.clients.array[0];
     }
     return client;
 }
@@ -377,7 +1055,7 @@ static vkcapture_client_t *find_client_by_id(int id)
 {
     vkcapture_client_t *client = NULL;
     for (size_t i = 0; i < server.clients.num; i++) {
-        vkcapture_client_t *c = server.clients.array + i;
+        vkcapture_client_t *c = server.clients.array[i];
         if (c->id == id) {
             client = c;
             break;
@@ -386,143 +1064,657 @@ static vkcapture_client_t *find_client_by_id(int id)
     return client;
 }
 
-static void fill_capture_control_data(struct capture_control_data *msg, vkcapture_client_t *client)
+static uint8_t client_capture_mode(vkcapture_client_t *client)
+{
+    if (!client->activated) {
+        return CAPTURE_CONTROL_STOP;
+    }
+    uint8_t mode = CAPTURE_CONTROL_PAUSE;
+    for (size_t i = 0; i < sources.num; ++i) {
+        const vkcapture_source_t *s = sources.array[i];
+        if (s->client_id != client->id || s->client_paused) {
+            continue;
+        }
+        if (!s->client_snapshot) {
+            return CAPTURE_CONTROL_CAPTURE;
+        }
+        mode = CAPTURE_CONTROL_SNAPSHOT;
+    }
+    return mode;
+}
+
+static void query_gl_device()
+{
+    if (p_glGetUnsignedBytei_vEXT) {
+        return;
+    }
+    obs_enter_graphics();
+    p_glGetUnsignedBytei_vEXT = (typeof(p_glGetUnsignedBytei_vEXT))
+        eglGetProcAddress("glGetUnsignedBytei_vEXT");
+    if (p_glGetUnsignedBytei_vEXT) {
+        p_glGetUnsignedBytei_vEXT(0x9597, 0, gl_device_uuid);
+        p_glGetUnsignedBytei_vEXT(0x9598, 0, gl_driver_uuid);
+    }
+    obs_leave_graphics();
+}
+
+static void fill_capture_control_data(struct capture_control_data *msg, vkcapture_client_t *client)
+{
+    query_gl_device();
+
+    msg->capturing = client_capture_mode(client);
+    msg->flags = CAPTURE_CONTROL_FRAMES;
+
+    // Union of regions of all sources using this client
+    int x0 = INT_MAX, y0 = INT_MAX, x1 = 0, y1 = 0;
+    for (size_t i = 0; i < sources.num; ++i) {
+        const vkcapture_source_t *s = sources.array[i];
+        if (s->client_id != client->id) {
+            continue;
+        }
+        if (!s->client_region.width || !s->client_region.height) {
+            x0 = INT_MAX;
+            break;
+        }
+        x0 = MIN(x0, s->client_region.x);
+        y0 = MIN(y0, s->client_region.y);
+        x1 = MAX(x1, s->client_region.x + s->client_region.width);
+        y1 = MAX(y1, s->client_region.y + s->client_region.height);
+    }
+    if (x0 < x1 && y0 < y1) {
+        msg->region_x = x0;
+        msg->region_y = y0;
+        msg->region_width = MIN(x1 - x0, UINT16_MAX);
+        msg->region_height = MIN(y1 - y0, UINT16_MAX);
+    }
+
+    for (size_t i = 0; i < sources.num; ++i) {
+        const vkcapture_source_t *s = sources.array[i];
+        if (s->client_id == client->id && s->client_pacing) {
+            msg->ring_size = CAPTURE_MAX_SLOTS;
+            break;
+        }
+    }
+
+    // Host mapped textures are only uploaded when client sends a new frame
+    if (!msg->ring_size && client->import_failures == IMPORT_LINEAR_HOST_MAPPED) {
+        msg->ring_size = 1;
+    }
+
+    msg->no_modifiers = !!(client->import_failures == IMPORT_NO_MODIFIERS);
+    msg->linear = !!(client->import_failures == IMPORT_LINEAR
+        || client->import_failures == IMPORT_LINEAR_HOST_MAPPED);
+    msg->map_host = !!(client->import_failures == IMPORT_LINEAR_HOST_MAPPED);
+    memcpy(msg->device_uuid, gl_device_uuid, 16);
+}
+
+static bool write_modifier_data(vkcapture_client_t *client, const struct capture_modifier_data *md)
+{
+    ssize_t ret = write(client->sockfd, md, sizeof(struct capture_modifier_data));
+    if (ret != sizeof(struct capture_modifier_data)) {
+        blog(LOG_WARNING, "Socket write error: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static void send_modifier_data(vkcapture_client_t *client)
+{
+    if (!dmabuf_modifiers_queried) {
+        query_dmabuf_modifiers();
+    }
+
+    // Only offer the modifier that worked last time, if OBS still supports it
+    bool use_cached = false;
+    if (client->cached_tier == IMPORT_DEFAULT && client->cached_modifier != DRM_FORMAT_MOD_INVALID) {
+        for (size_t i = 0; i < dmabuf_modifiers.num && !use_cached; ++i) {
+            const struct capture_modifier_data *md = dmabuf_modifiers.array + i;
+            for (int j = 0; j < md->count; ++j) {
+                if (md->format == client->cached_format && md->modifiers[j] == client->cached_modifier) {
+                    use_cached = true;
+                }
+            }
+        }
+    }
+
+    // Cached entry goes first so it is never the one a client drops
+    if (use_cached) {
+        struct capture_modifier_data md = {0};
+        md.type = CAPTURE_MODIFIER_DATA_TYPE;
+        md.count = 1;
+        md.format = client->cached_format;
+        md.modifiers[0] = client->cached_modifier;
+        if (!write_modifier_data(client, &md)) {
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < dmabuf_modifiers.num; ++i) {
+        const struct capture_modifier_data *md = dmabuf_modifiers.array + i;
+        if (use_cached && md->format == client->cached_format) {
+            continue;
+        }
+        if (!write_modifier_data(client, md)) {
+            return;
+        }
+    }
+}
+
+static void send_capture_control_data(vkcapture_client_t *client)
+{
+    // Client only allocates buffers with modifiers OBS can import. Older
+    // clients read one control message at a time and don't know modifier data.
+    if (!client->modifiers_sent && (client->cdata.flags & CAPTURE_CLIENT_MODIFIERS)) {
+        send_modifier_data(client);
+        client->modifiers_sent = true;
+    }
+
+    struct capture_control_data msg = {0};
+    fill_capture_control_data(&msg, client);
+    client->capturing = msg.capturing;
+    ssize_t ret = write(client->sockfd, &msg, sizeof(msg));
+    if (ret != sizeof(msg)) {
+        blog(LOG_WARNING, "Socket write error: %s", strerror(errno));
+    }
+}
+
+// Called with server.mutex locked
+static void send_release_data(vkcapture_client_t *client)
+{
+    // Slots sampled by any source of the client must not be overwritten
+    if (!(client->cdata.flags & CAPTURE_CLIENT_RELEASE)) {
+        return;
+    }
+
+    uint8_t held = 0;
+    for (size_t i = 0; i < sources.num; ++i) {
+        const vkcapture_source_t *s = sources.array[i];
+        if (s->client_id != client->id || s->nslots <= 1) {
+            continue;
+        }
+        held |= 1 << s->slot;
+        // Uploader may still be copying from an older slot
+        const vkcapture_texture_t *u = s->textures[0];
+        for (int slot = 0; slot < s->nslots && u->uploader && u->upload_busy; ++slot) {
+            if (s->textures[slot] == u->upload_src) {
+                held |= 1 << slot;
+            }
+        }
+    }
+    if (held == client->held) {
+        return;
+    }
+    client->held = held;
+
+    struct capture_release_data msg = {0};
+    msg.type = CAPTURE_RELEASE_DATA_TYPE;
+    msg.held = held;
+    ssize_t ret = write(client->sockfd, &msg, sizeof(msg));
+    if (ret != sizeof(msg)) {
+        blog(LOG_WARNING, "Socket write error: %s", strerror(errno));
+    }
+}
+
+static void client_strategy_key(vkcapture_client_t *client, struct dstr *key)
+{
+    query_gl_device();
+
+    const uint8_t *uuids[] = {
+        client->cdata.device_uuid,
+        client->cdata.driver_uuid,
+        gl_device_uuid,
+        gl_driver_uuid,
+    };
+    dstr_printf(key, "%.*s", (int)sizeof(client->cdata.exe), client->cdata.exe);
+    for (size_t i = 0; i < sizeof(uuids) / sizeof(uuids[0]); ++i) {
+        dstr_cat(key, ":");
+        for (int j = 0; j < 16; ++j) {
+            dstr_catf(key, "%02x", uuids[i][j]);
+        }
+    }
+}
+
+static void client_load_strategy(vkcapture_client_t *client)
+{
+    client->strategy_loaded = true;
+    client->cached_tier = -1;
+    if (!import_cache) {
+        return;
+    }
+
+    struct dstr key = {0};
+    client_strategy_key(client, &key);
+    obs_data_t *entry = obs_data_get_obj(import_cache, key.array);
+    dstr_free(&key);
+
+    if (!entry) {
+        blog(LOG_INFO, "Client %d calibrating texture import", client->id);
+        client->calibrating = true;
+        return;
+    }
+
+    client->cached_tier = MAX(MIN(obs_data_get_int(entry, "tier"), IMPORT_FAILURES_MAX), IMPORT_DEFAULT);
+    client->cached_format = obs_data_get_int(entry, "format");
+    client->cached_modifier = obs_data_get_int(entry, "modifier");
+    client->import_failures = client->cached_tier;
+    obs_data_release(entry);
+
+    blog(LOG_INFO, "Client %d using cached texture import %s", client->id,
+        import_attempt_str(client->import_failures));
+}
+
+static void client_save_strategy(vkcapture_client_t *client, int tier, uint32_t format, uint64_t modifier)
+{
+    client->cached_tier = tier;
+    client->cached_format = format;
+    client->cached_modifier = modifier;
+    if (!import_cache) {
+        return;
+    }
+
+    struct dstr key = {0};
+    client_strategy_key(client, &key);
+    obs_data_t *entry = obs_data_create();
+    obs_data_set_int(entry, "tier", tier);
+    obs_data_set_int(entry, "format", format);
+    obs_data_set_int(entry, "modifier", (long long)modifier);
+    obs_data_set_obj(import_cache, key.array, entry);
+    obs_data_release(entry);
+    dstr_free(&key);
+
+    if (!obs_data_save_json_safe(import_cache, import_cache_path, "tmp", "bak")) {
+        blog(LOG_WARNING, "Failed to save import cache '%s'", import_cache_path);
+    }
+}
+
+static void client_import_result(vkcapture_client_t *client, int tier, bool ok, int64_t cost,
+    const struct capture_texture_data *td)
+{
+    atomic_fetch_add(&client->metrics.import_attempts, 1);
+    atomic_fetch_add(&client->metrics.import_failures, !ok);
+    atomic_store(&client->metrics.import_tier, tier);
+    atomic_store(&client->metrics.import_latency_ns, cost);
+
+    // Client reads frames back into host memory, import tier makes no difference
+    if (td->host_memory) {
+        client->calibrating = false;
+        if (!ok) {
+            blog(LOG_ERROR, "Could not create texture from host memory");
+        }
+        return;
+    }
+
+    if (client->calibrating) {
+        // Try every tier once, then settle on the cheapest one
+        client->import_costs[tier] = ok ? cost : -1;
+        client->import_modifiers[tier] = td->modifier;
+        if (ok) {
+            blog(LOG_INFO, "Texture import %s cost %.2f ms", import_attempt_str(tier), cost / 1000000.0);
+        }
+        if (tier < IMPORT_FAILURES_MAX) {
+            client->import_failures = tier + 1;
+            send_capture_control_data(client);
+            return;
+        }
+        client->calibrating = false;
+
+        // GPU cost of sampling linear textures is not measured, so lower tiers win close calls
+        int best = -1;
+        for (int i = 0; i <= IMPORT_FAILURES_MAX; ++i) {
+            if (client->import_costs[i] >= 0
+                && (best < 0 || client->import_costs[i] * 4 < client->import_costs[best] * 3)) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            blog(LOG_ERROR, "Could not create texture from dmabuf source");
+            return;
+        }
+        blog(LOG_INFO, "Client %d calibrated texture import %s", client->id, import_attempt_str(best));
+        client->import_failures = best;
+        client_save_strategy(client, best, td->format, client->import_modifiers[best]);
+        if (best != tier) {
+            send_capture_control_data(client);
+        }
+        return;
+    }
+
+    if (ok) {
+        if (tier != client->cached_tier || td->modifier != client->cached_modifier) {
+            client_save_strategy(client, tier, td->format, td->modifier);
+        }
+        return;
+    }
+
+    if (client->import_failures < IMPORT_FAILURES_MAX) {
+        client->import_failures++;
+        blog(LOG_WARNING, "Asking client to create texture %s",
+            import_attempt_str(client->import_failures));
+        send_capture_control_data(client);
+    } else {
+        blog(LOG_ERROR, "Could not create texture from dmabuf source");
+    }
+}
+
+static int64_t client_timeout(vkcapture_client_t *client)
+{
+    // Dead processes are noticed through pidfd, this only catches hung ones
+    if (!client->handshake_ns) {
+        return CLIENT_TIMEOUT_MAX;
+    }
+    return MIN(MAX(client->handshake_ns * 4, CLIENT_TIMEOUT_MIN), CLIENT_TIMEOUT_MAX);
+}
+
+static void activate_client(vkcapture_source_t *ctx, vkcapture_client_t *client, bool activate)
+{
+    const bool was_activated = client->activated;
+    atomic_store(&ctx->metrics.client_id, activate ? client->id : 0);
+    if (activate) {
+        atomic_fetch_add(&ctx->metrics.connects, 1);
+        ctx->client_snapshot = ctx->snapshot;
+        ctx->client_region = ctx->region;
+        ctx->client_pacing = ctx->frame_delay > 0;
+        ctx->client_paused = false;
+        client->activated++;
+    } else {
+        client->activated--;
+    }
+    if (was_activated == !!client->activated) {
+        // Mode or region may have changed, client keeps the buffer if not
+        if (client->activated) {
+            send_capture_control_data(client);
+        }
+        return;
+    }
+    buffer_retire(atomic_exchange(&client->buffer, NULL));
+    if (!client->strategy_loaded) {
+        client_load_strategy(client);
+    }
+    send_capture_control_data(client);
+    client->handshake_start = clock_ns();
+    client->timeout = client->handshake_start + client_timeout(client);
+}
+
+static void update_client_mode(vkcapture_client_t *client)
+{
+    if (client->capturing != client_capture_mode(client)) {
+        send_capture_control_data(client);
+    }
+}
+
+// Makes the GPU wait for the client copy before OBS samples the slot.
+// Sources render after all of them were ticked, one wait covers every source.
+static void fence_wait(int fence)
 {
-    if (!p_glGetUnsignedBytei_vEXT) {
-        obs_enter_graphics();
-        p_glGetUnsignedBytei_vEXT = (typeof(p_glGetUnsignedBytei_vEXT))
-            eglGetProcAddress("glGetUnsignedBytei_vEXT");
-        if (p_glGetUnsignedBytei_vEXT) {
-            p_glGetUnsignedBytei_vEXT(0x9597, 0, gl_device_uuid);
+    static PFNEGLCREATESYNCKHRPROC create_sync = NULL;
+    static PFNEGLDESTROYSYNCKHRPROC destroy_sync = NULL;
+    static PFNEGLWAITSYNCKHRPROC wait_sync = NULL;
+    static bool queried = false;
+
+    obs_enter_graphics();
+    EGLDisplay dpy = eglGetCurrentDisplay();
+    if (!queried) {
+        const char *exts = eglQueryString(dpy, EGL_EXTENSIONS);
+        if (exts && strstr(exts, "EGL_ANDROID_native_fence_sync") && strstr(exts, "EGL_KHR_wait_sync")) {
+            create_sync = (PFNEGLCREATESYNCKHRPROC)eglGetProcAddress("eglCreateSyncKHR");
+            destroy_sync = (PFNEGLDESTROYSYNCKHRPROC)eglGetProcAddress("eglDestroySyncKHR");
+            wait_sync = (PFNEGLWAITSYNCKHRPROC)eglGetProcAddress("eglWaitSyncKHR");
         }
-        obs_leave_graphics();
+        if (!create_sync || !destroy_sync || !wait_sync) {
+            blog(LOG_WARNING, "Native fence sync not supported, frames are not synchronized");
+        }
+        queried = true;
     }
 
-    msg->no_modifiers = !!(client->import_failures == IMPORT_NO_MODIFIERS);
-    msg->linear = !!(client->import_failures == IMPORT_LINEAR
-        || client->import_failures == IMPORT_LINEAR_HOST_MAPPED);
-    msg->map_host = !!(client->import_failures == IMPORT_LINEAR_HOST_MAPPED);
-    memcpy(msg->device_uuid, gl_device_uuid, 16);
+    EGLSyncKHR sync = EGL_NO_SYNC_KHR;
+    if (create_sync && destroy_sync && wait_sync) {
+        const EGLint attribs[] = {
+            EGL_SYNC_NATIVE_FENCE_FD_ANDROID, fence,
+            EGL_NONE,
+        };
+        sync = create_sync(dpy, EGL_SYNC_NATIVE_FENCE_ANDROID, attribs);
+    }
+    if (sync != EGL_NO_SYNC_KHR) {
+        // Sync owns the fd now
+        wait_sync(dpy, sync, 0);
+        destroy_sync(dpy, sync);
+    } else {
+        close(fence);
+    }
+    obs_leave_graphics();
 }
 
-static void activate_client(vkcapture_source_t *ctx, vkcapture_client_t *client, bool activate)
+static int select_slot(vkcapture_source_t *ctx)
 {
-    struct capture_control_data msg = {0};
-    if (activate && !client->activated++) {
-        msg.capturing = 1;
-    } else if (!activate && !--client->activated) {
-        msg.capturing = 0;
-    } else {
-        return;
+    // Frame pacing: newest frame presented before the delayed video frame time
+    uint64_t ts[CAPTURE_MAX_SLOTS];
+    for (int i = 0; i < ctx->nslots; ++i) {
+        ts[i] = atomic_load(&ctx->buffer->timestamps[i]);
     }
-    fill_capture_control_data(&msg, client);
-    client->buf_id = 0;
-    for (int i = 0; i < 4; ++i) {
-        if (client->buf_fds[i] >= 0) {
-            close(client->buf_fds[i]);
-            client->buf_fds[i] = -1;
+    const uint64_t target = ctx->frame_delay
+        ? obs_get_video_frame_time() - ctx->frame_delay * UINT64_C(1000000) : UINT64_MAX;
+
+    int newest = -1;
+    for (int i = 0; i < ctx->nslots; ++i) {
+        if (ts[i] && (newest < 0 || ts[i] > ts[newest])) {
+            newest = i;
         }
     }
-    memset(&client->tdata, 0, sizeof(client->tdata));
-    ssize_t ret = write(client->sockfd, &msg, sizeof(msg));
-    if (ret != sizeof(msg)) {
-        blog(LOG_WARNING, "Socket write error: %s", strerror(errno));
+    if (newest < 0) {
+        return ctx->slot;
+    }
+
+    // Slot after newest is the next one client will write to
+    const int next = ctx->nslots > 2 ? (newest + 1) % ctx->nslots : -1;
+    int best = -1;
+    int oldest = newest;
+    for (int i = 0; i < ctx->nslots; ++i) {
+        if (!ts[i] || i == next) {
+            continue;
+        }
+        if (ts[i] <= target && (best < 0 || ts[i] > ts[best])) {
+            best = i;
+        }
+        if (ts[i] < ts[oldest]) {
+            oldest = i;
+        }
+    }
+    return best >= 0 ? best : oldest;
+}
+
+static void update_view(vkcapture_source_t *ctx)
+{
+    // Texture may contain union of regions from multiple sources
+    const struct capture_region *r = &ctx->region;
+    const int x0 = MAX(r->x, ctx->tdata.crop_x) - ctx->tdata.crop_x;
+    const int y0 = MAX(r->y, ctx->tdata.crop_y) - ctx->tdata.crop_y;
+    const int x1 = MIN(r->x + r->width - ctx->tdata.crop_x, ctx->tdata.width);
+    const int y1 = MIN(r->y + r->height - ctx->tdata.crop_y, ctx->tdata.height);
+    if (!r->width || !r->height || x1 <= x0 || y1 <= y0) {
+        ctx->view.x = 0;
+        ctx->view.y = 0;
+        ctx->view.width = ctx->tdata.width;
+        ctx->view.height = ctx->tdata.height;
+        return;
     }
-    client->timeout = clock_ns() + 5000000000; // 5s timeout
+    ctx->view.x = x0;
+    ctx->view.y = y0;
+    ctx->view.width = x1 - x0;
+    ctx->view.height = y1 - y0;
 }
 
 static void vkcapture_source_video_tick(void *data, float seconds)
 {
     vkcapture_source_t *ctx = data;
 
+    buffers_collect();
+
     if (!obs_source_showing(ctx->source)) {
+        // Client keeps the texture, but stops copying frames
+        if (ctx->client_id && !ctx->client_paused) {
+            pthread_mutex_lock(&server.mutex);
+            vkcapture_client_t *client = find_client_by_id(ctx->client_id);
+            ctx->client_paused = true;
+            if (client) {
+                update_client_mode(client);
+            }
+            pthread_mutex_unlock(&server.mutex);
+        }
         return;
     }
 
+    // Only take references to published buffers while holding the lock,
+    // texture import itself must not block the server thread
+    vkcapture_buffer_t *import = NULL;
+    int tier = IMPORT_DEFAULT;
+    bool release = false;
+    bool purge = false;
+
     pthread_mutex_lock(&server.mutex);
 
     if (ctx->client_id) {
         vkcapture_client_t *client = find_client_by_id(ctx->client_id);
+        vkcapture_buffer_t *buffer = client ? atomic_load(&client->buffer) : NULL;
         if (!client) {
             ctx->client_id = 0;
-            destroy_texture(ctx);
-        } else if (ctx->buf_id != client->buf_id) {
-            destroy_texture(ctx);
-            memcpy(&ctx->tdata, &client->tdata, sizeof(client->tdata));
-
-            blog(LOG_INFO, "Creating texture from dmabuf %dx%d modifier:%" PRIu64,
-                    ctx->tdata.width, ctx->tdata.height, ctx->tdata.modifier);
-
-            uint32_t strides[4];
-            uint32_t offsets[4];
-            uint64_t modifiers[4];
-            for (uint8_t i = 0; i < ctx->tdata.nfd; ++i) {
-                strides[i] = ctx->tdata.strides[i];
-                offsets[i] = ctx->tdata.offsets[i];
-                modifiers[i] = ctx->tdata.modifier;
-                blog(LOG_INFO, " [%d] fd:%d stride:%d offset:%d", i, client->buf_fds[i], strides[i], offsets[i]);
-            }
-
-            if (client->import_failures == IMPORT_LINEAR_HOST_MAPPED) {
-                lseek(client->buf_fds[0], 0, SEEK_SET);
-                client->map_size = lseek(client->buf_fds[0], 0, SEEK_END);
-                client->map_memory = mmap(NULL, client->map_size, PROT_READ, MAP_SHARED, client->buf_fds[0], 0);
-                if (client->map_memory == MAP_FAILED) {
-                    client->map_memory = NULL;
-                    blog(LOG_ERROR, "Failed to map dmabuf '%s'", strerror(errno));
-                } else {
-                    obs_enter_graphics();
-                    ctx->texture = gs_texture_create(ctx->tdata.width, ctx->tdata.height,
-                        drm_format_to_gs(ctx->tdata.format), 1, NULL, GS_DYNAMIC);
-                    obs_leave_graphics();
+            release = purge = true;
+        } else if (ctx->buffer != buffer) {
+            if (buffer) {
+                atomic_fetch_add(&buffer->refs, 1);
+                import = buffer;
+                tier = client->import_failures;
+                if (client->timeout) {
+                    const int64_t latency = clock_ns() - client->handshake_start;
+                    client->handshake_ns = client->handshake_ns
+                        ? (client->handshake_ns * 3 + latency) / 4 : latency;
+                    atomic_store(&client->metrics.handshake_latency_ns, latency);
+                    client->timeout = 0;
                 }
             } else {
-                obs_enter_graphics();
-                ctx->texture = gs_texture_create_from_dmabuf(ctx->tdata.width, ctx->tdata.height,
-                    ctx->tdata.format, drm_format_to_gs(ctx->tdata.format), ctx->tdata.nfd, client->buf_fds,
-                    strides, offsets, ctx->tdata.modifier != DRM_FORMAT_MOD_INVALID ? modifiers : NULL);
-                obs_leave_graphics();
-            }
-
-            if (!ctx->texture) {
-                if (client->import_failures < IMPORT_FAILURES_MAX) {
-                    client->import_failures++;
-                    blog(LOG_WARNING, "Asking client to create texture %s",
-                        import_attempt_str(client->import_failures));
-                    struct capture_control_data msg = {0};
-                    msg.capturing = client->activated ? 1 : 0;
-                    fill_capture_control_data(&msg, client);
-                    ssize_t ret = write(client->sockfd, &msg, sizeof(msg));
-                    if (ret != sizeof(msg)) {
-                        blog(LOG_WARNING, "Socket write error: %s", strerror(errno));
-                    }
-                } else {
-                    blog(LOG_ERROR, "Could not create texture from dmabuf source");
-                }
+                release = true;
             }
-            ctx->buf_id = client->buf_id;
-            client->timeout = 0;
         } else if (client != find_matching_client(ctx)) {
-            activate_client(ctx, client, false);
             ctx->client_id = 0;
-            destroy_texture(ctx);
+            activate_client(ctx, client, false);
+            release = true;
         } else if (client->timeout && clock_ns() > client->timeout) {
             blog(LOG_INFO, "Client %d not responding, disconnecting...", client->id);
+            atomic_fetch_add(&ctx->metrics.timeouts, 1);
             client->unresponsive = true;
             server_wakeup();
             ctx->client_id = 0;
-            destroy_texture(ctx);
+            release = true;
         }
     } else {
         vkcapture_client_t *client = find_matching_client(ctx);
         if (client) {
-            activate_client(ctx, client, true);
             ctx->client_id = client->id;
+            activate_client(ctx, client, true);
+        }
+    }
+
+    if (ctx->client_id) {
+        vkcapture_client_t *client = find_client_by_id(ctx->client_id);
+        if (ctx->client_snapshot != ctx->snapshot || ctx->client_paused) {
+            ctx->client_snapshot = ctx->snapshot;
+            ctx->client_paused = false;
+            update_client_mode(client);
+        }
+        if (memcmp(&ctx->client_region, &ctx->region, sizeof(ctx->region))
+            || ctx->client_pacing != (ctx->frame_delay > 0)) {
+            ctx->client_region = ctx->region;
+            ctx->client_pacing = ctx->frame_delay > 0;
+            send_capture_control_data(client);
+        }
+        bool request = atomic_exchange(&ctx->snapshot_requested, false);
+        const int64_t now = clock_ns();
+        if (ctx->snapshot && ctx->snapshot_interval && now >= ctx->next_snapshot) {
+            request = true;
+        }
+        // Snapshot mode: each request makes the client copy one more frame
+        if (request && client->capturing == CAPTURE_CONTROL_SNAPSHOT && atomic_load(&client->buffer)) {
+            send_capture_control_data(client);
+            ctx->next_snapshot = now + ctx->snapshot_interval * 1000000LL;
         }
     }
 
     pthread_mutex_unlock(&server.mutex);
 
+    if (release) {
+        destroy_texture(ctx);
+    }
+
+    if (purge) {
+        texture_cache_purge(false);
+    }
+
+    // libobs creates the EGLImage and texture inside gs_texture_create_from_dmabuf
+    // and can't wrap one made elsewhere, so import stays in the graphics context.
+    // Import duration is reported as import_latency_ns metric
+    if (import) {
+        vkcapture_import_t job = {
+            .buffer = import,
+            .client_id = ctx->client_id,
+            .tier = tier,
+        };
+        import_run(&job);
+
+        destroy_texture(ctx);
+        ctx->buffer = job.buffer;
+        job.buffer = NULL;
+        memcpy(&ctx->tdata, &ctx->buffer->tdata[0], sizeof(ctx->tdata));
+        // Otherwise keep the buffer reference, so the same buffer is not imported again
+        if (job.imported) {
+            memcpy(ctx->textures, job.textures, sizeof(ctx->textures));
+            memset(job.textures, 0, sizeof(job.textures));
+            ctx->nslots = ctx->buffer->nslots;
+            ctx->slot = 0;
+            atomic_fetch_add(&ctx->metrics.imports, 1);
+        }
+
+        // Sources sharing the client import the same buffer, only first one counts
+        pthread_mutex_lock(&server.mutex);
+        vkcapture_client_t *client = find_client_by_id(ctx->client_id);
+        if (client && client->result_seq != ctx->buffer->seq) {
+            client->result_seq = ctx->buffer->seq;
+            client_import_result(client, job.tier, job.imported, job.cost, &ctx->buffer->tdata[0]);
+        }
+        pthread_mutex_unlock(&server.mutex);
+
+        import_release(&job);
+    }
+
+    if (ctx->nslots) {
+        ctx->slot = select_slot(ctx);
+        vkcapture_texture_t *t = ctx->textures[ctx->slot];
+        const uint64_t timestamp = atomic_load(&ctx->buffer->timestamps[ctx->slot]);
+        if (ctx->textures[0]->uploader) {
+            t = ctx->textures[0];
+            if (t->upload_texture) {
+                texture_upload_update(t, ctx->textures[ctx->slot], timestamp,
+                    &ctx->buffer->damage_rows[ctx->slot]);
+            }
+        }
+        ctx->texture = t->texture;
+        if (ctx->nslots > 1) {
+            pthread_mutex_lock(&server.mutex);
+            vkcapture_client_t *client = find_client_by_id(ctx->client_id);
+            if (client) {
+                send_release_data(client);
+            }
+            pthread_mutex_unlock(&server.mutex);
+        }
+        const int fence = atomic_exchange(&ctx->buffer->fences[ctx->slot], -1);
+        if (fence >= 0) {
+            fence_wait(fence);
+        }
+        if (timestamp) {
+            atomic_store(&ctx->metrics.frame_age_ns, clock_ns() - (int64_t)timestamp);
+        }
+    }
+
+    update_view(ctx);
+
     UNUSED_PARAMETER(seconds);
 }
 
@@ -538,28 +1730,9 @@ static void vkcapture_source_render(void *data, gs_effect_t *effect)
         cursor_update(ctx);
     }
 
-    pthread_mutex_lock(&server.mutex);
-    vkcapture_client_t *client = find_client_by_id(ctx->client_id);
-    if (!client) {
-        pthread_mutex_unlock(&server.mutex);
-        return;
-    }
-    void *memory = client->map_memory;
-    int stride = client->tdata.strides[0];
-    int fd = client->buf_fds[0];
-    pthread_mutex_unlock(&server.mutex);
-
-    if (memory) {
-        struct dma_buf_sync sync;
-        sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
-        ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
-
-        obs_enter_graphics();
-        gs_texture_set_image(ctx->texture, memory, stride, false);
-        obs_leave_graphics();
-
-        sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
-        ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+    vkcapture_texture_t *t = ctx->textures[0];
+    if (t->uploader && !t->upload_texture) {
+        texture_upload_mapped(t, ctx->textures[ctx->slot]);
     }
 
     const enum gs_color_space color_space = gs_get_color_space();
@@ -578,7 +1751,13 @@ static void vkcapture_source_render(void *data, gs_effect_t *effect)
 
     while (gs_effect_loop(effect, tech_name)) {
         gs_effect_set_float(gs_effect_get_param_by_name(effect, "multiplier"), multiplier);
-        gs_draw_sprite(ctx->texture, ctx->tdata.flip ? GS_FLIP_V : 0, 0, 0);
+        if (ctx->tdata.flip) {
+            gs_draw_sprite_subregion(ctx->texture, GS_FLIP_V, ctx->view.x,
+                ctx->tdata.height - ctx->view.y - ctx->view.height, ctx->view.width, ctx->view.height);
+        } else {
+            gs_draw_sprite_subregion(ctx->texture, 0, ctx->view.x, ctx->view.y,
+                ctx->view.width, ctx->view.height);
+        }
         if (ctx->allow_transparency && ctx->show_cursor) {
             cursor_render(ctx);
         }
@@ -607,13 +1786,13 @@ static const char *vkcapture_source_get_name(void *data)
 static uint32_t vkcapture_source_get_width(void *data)
 {
     const vkcapture_source_t *ctx = data;
-    return ctx->tdata.width;
+    return ctx->view.width;
 }
 
 static uint32_t vkcapture_source_get_height(void *data)
 {
     const vkcapture_source_t *ctx = data;
-    return ctx->tdata.height;
+    return ctx->view.height;
 }
 
 static void vkcapture_source_get_defaults(obs_data_t *defaults)
@@ -621,6 +1800,13 @@ static void vkcapture_source_get_defaults(obs_data_t *defaults)
     obs_data_set_default_bool(defaults, "show_cursor", true);
     obs_data_set_default_bool(defaults, "allow_transparency", false);
     obs_data_set_default_bool(defaults, "force_hdr", false);
+    obs_data_set_default_bool(defaults, "snapshot", false);
+    obs_data_set_default_int(defaults, "snapshot_interval", 1000);
+    obs_data_set_default_int(defaults, "region_x", 0);
+    obs_data_set_default_int(defaults, "region_y", 0);
+    obs_data_set_default_int(defaults, "region_width", 0);
+    obs_data_set_default_int(defaults, "region_height", 0);
+    obs_data_set_default_int(defaults, "frame_delay", 0);
 }
 
 static obs_properties_t *vkcapture_source_get_properties(void *data)
@@ -639,7 +1825,7 @@ static obs_properties_t *vkcapture_source_get_properties(void *data)
         bool window_found = false;
         pthread_mutex_lock(&server.mutex);
         for (size_t i = 0; i < server.clients.num; i++) {
-            vkcapture_client_t *client = server.clients.array + i;
+            vkcapture_client_t *client = server.clients.array[i];
             obs_property_list_add_string(p, client->cdata.exe, client->cdata.exe);
             if (ctx->window && !strcmp(client->cdata.exe, ctx->window)) {
                 window_found = true;
@@ -667,6 +1853,19 @@ static obs_properties_t *vkcapture_source_get_properties(void *data)
 
     obs_properties_add_bool(props, "allow_transparency", obs_module_text("AllowTransparency"));
     obs_properties_add_bool(props, "force_hdr", obs_module_text("ForceHDR"));
+    obs_properties_add_bool(props, "snapshot", obs_module_text("SnapshotMode"));
+    p = obs_properties_add_int(props, "snapshot_interval", obs_module_text("SnapshotInterval"), 0, 3600000, 100);
+    obs_property_int_set_suffix(p, " ms");
+
+    obs_properties_t *region = obs_properties_create();
+    obs_properties_add_int(region, "region_x", obs_module_text("RegionX"), 0, UINT16_MAX, 1);
+    obs_properties_add_int(region, "region_y", obs_module_text("RegionY"), 0, UINT16_MAX, 1);
+    obs_properties_add_int(region, "region_width", obs_module_text("RegionWidth"), 0, UINT16_MAX, 1);
+    obs_properties_add_int(region, "region_height", obs_module_text("RegionHeight"), 0, UINT16_MAX, 1);
+    obs_properties_add_group(props, "region", obs_module_text("CaptureRegion"), OBS_GROUP_NORMAL, region);
+
+    p = obs_properties_add_int(props, "frame_delay", obs_module_text("FrameDelay"), 0, 100, 1);
+    obs_property_int_set_suffix(p, " ms");
 
     return props;
 }
@@ -710,232 +1909,498 @@ static bool server_wakeup()
     return write(server.eventfd, &q, sizeof(q)) == sizeof(q);
 }
 
-static void server_add_fd(int fd, int events)
+static bool server_watch_fd(int fd, struct server_watch *watch)
+{
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = watch;
+    if (epoll_ctl(server.epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        blog(LOG_ERROR, "Failed to add fd to epoll: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static void server_cleanup_client(vkcapture_client_t *client)
 {
-    struct pollfd p;
-    p.fd = fd;
-    p.events = events;
-    da_push_back(server.fds, &p);
+    pthread_mutex_lock(&server.mutex);
+
+    blog(LOG_INFO, "Client %d disconnected", client->id);
+
+    epoll_ctl(server.epollfd, EPOLL_CTL_DEL, client->sockfd, NULL);
+    close(client->sockfd);
+    if (client->pidfd >= 0) {
+        epoll_ctl(server.epollfd, EPOLL_CTL_DEL, client->pidfd, NULL);
+        close(client->pidfd);
+    }
+
+    buffer_retire(atomic_exchange(&client->buffer, NULL));
+    buffer_release(client->current);
+    if (client->pending) {
+        buffer_free(client->pending);
+    }
+
+    da_erase_item(server.clients, &client);
+    bfree(client);
+
+    pthread_mutex_unlock(&server.mutex);
 }
 
-static void server_remove_fd(int fd)
+static int server_pidfd_open(pid_t pid)
 {
-    for (size_t i = 0; i < server.fds.num; ++i) {
-        struct pollfd *p = server.fds.array + i;
-        if (p->fd == fd) {
-            da_erase(server.fds, i);
-            break;
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static void server_accept()
+{
+    // Drain all pending connections, many processes may connect at once
+    while (true) {
+        int clientfd = accept4(server.sockfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (clientfd < 0) {
+            if (errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                blog(LOG_ERROR, "Cannot accept unix socket: %s", strerror(errno));
+            }
+            return;
         }
+
+        vkcapture_client_t *client = bzalloc(sizeof(vkcapture_client_t));
+        client->id = ++server.clientid;
+        client->sockfd = clientfd;
+        client->pidfd = -1;
+        client->cached_tier = -1;
+        client->watch.type = SERVER_WATCH_CLIENT;
+        client->watch.client = client;
+        client->pid_watch.type = SERVER_WATCH_CLIENT_PID;
+        client->pid_watch.client = client;
+        if (!server_watch_fd(client->sockfd, &client->watch)) {
+            close(clientfd);
+            bfree(client);
+            continue;
+        }
+        struct ucred cred = {0};
+        socklen_t cred_len = sizeof(cred);
+        if (getsockopt(client->sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0) {
+            blog(LOG_WARNING, "Failed to get socket credentials: %s", strerror(errno));
+        }
+        // Socket may outlive the process if it was inherited by a child,
+        // pidfd becomes readable as soon as the process exits
+        if (cred.pid > 0) {
+            client->pidfd = server_pidfd_open(cred.pid);
+            if (client->pidfd < 0) {
+                blog(LOG_DEBUG, "Failed to open pidfd: %s", strerror(errno));
+            } else if (!server_watch_fd(client->pidfd, &client->pid_watch)) {
+                close(client->pidfd);
+                client->pidfd = -1;
+            }
+        }
+        pthread_mutex_lock(&server.mutex);
+        da_push_back(server.clients, &client);
+        pthread_mutex_unlock(&server.mutex);
+        blog(LOG_INFO, "Client %d connected (pid=%d)", client->id, cred.pid);
     }
 }
 
-static bool server_has_event_on_fd(int fd)
+static void server_close_fds(struct msghdr *msg)
 {
-    for (size_t i = 0; i < server.fds.num; ++i) {
-        struct pollfd *p = server.fds.array + i;
-        if (p->fd == fd && p->revents) {
-            return true;
+    for (struct cmsghdr *cmsgh = CMSG_FIRSTHDR(msg); cmsgh; cmsgh = CMSG_NXTHDR(msg, cmsgh)) {
+        if (cmsgh->cmsg_level != SOL_SOCKET || cmsgh->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        const size_t nfd = (cmsgh->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < nfd; ++i) {
+            close(((int*)CMSG_DATA(cmsgh))[i]);
         }
     }
-    return false;
 }
 
-static void server_cleanup_client(vkcapture_client_t *client)
+static void server_read_client(vkcapture_client_t *client)
 {
-    pthread_mutex_lock(&server.mutex);
+    uint8_t buf[CAPTURE_TEXTURE_DATA_SIZE];
+    struct msghdr msg = {0};
+    struct iovec io = {
+        .iov_base = buf,
+        .iov_len = CAPTURE_TEXTURE_DATA_SIZE,
+    };
+    msg.msg_iov = &io;
+    msg.msg_iovlen = 1;
+
+    char cmsg_buf[CMSG_SPACE(sizeof(int)) * 4];
+    msg.msg_control = cmsg_buf;
 
-    blog(LOG_INFO, "Client %d disconnected", client->id);
+    while (true) {
+        msg.msg_controllen = sizeof(cmsg_buf);
+        const ssize_t n = recvmsg(client->sockfd, &msg, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            if (errno != ECONNRESET) {
+                blog(LOG_ERROR, "Socket recv error: %s", strerror(errno));
+            }
+        }
+        if (n <= 0) {
+            client->closed = true;
+            return;
+        }
 
-    close(client->sockfd);
-    server_remove_fd(client->sockfd);
+        if (buf[0] == CAPTURE_CLIENT_DATA_TYPE) {
+            server_close_fds(&msg);
+            if (n != CAPTURE_CLIENT_DATA_SIZE) {
+                client->closed = true;
+                return;
+            }
+            pthread_mutex_lock(&server.mutex);
+            memcpy(&client->cdata, buf, CAPTURE_CLIENT_DATA_SIZE);
+            pthread_mutex_unlock(&server.mutex);
+            return;
+        } else if (buf[0] == CAPTURE_TEXTURE_DATA_TYPE) {
+            const struct capture_texture_data *td = (const struct capture_texture_data *)buf;
+
+            struct cmsghdr *cmsgh = CMSG_FIRSTHDR(&msg);
+            if (!cmsgh || cmsgh->cmsg_level != SOL_SOCKET || cmsgh->cmsg_type != SCM_RIGHTS) {
+                client->closed = true;
+                return;
+            }
+
+            const size_t nfd = (cmsgh->cmsg_len - sizeof(struct cmsghdr)) / sizeof(int);
+
+            int buf_fds[4] = {-1, -1, -1, -1};
+            for (size_t i = 0; i < nfd; ++i) {
+                buf_fds[i] = ((int*)CMSG_DATA(cmsgh))[i];
+            }
+
+            const int nslots = MAX(td->nslots, 1);
+            if (n != CAPTURE_TEXTURE_DATA_SIZE || td->nfd != nfd
+                || nslots > CAPTURE_MAX_SLOTS || td->slot >= nslots) {
+                for (size_t i = 0; i < nfd; ++i) {
+                    close(buf_fds[i]);
+                }
+                client->closed = true;
+                return;
+            }
+
+            // Slots are sent in order, buffer is published after the last one
+            if (td->slot == 0) {
+                if (client->pending) {
+                    buffer_free(client->pending);
+                }
+                client->pending = buffer_create();
+            }
+            vkcapture_buffer_t *pending = client->pending;
+            if (!pending) {
+                for (size_t i = 0; i < nfd; ++i) {
+                    close(buf_fds[i]);
+                }
+                continue;
+            }
+            memcpy(&pending->tdata[td->slot], td, CAPTURE_TEXTURE_DATA_SIZE);
+            memcpy(pending->fds[td->slot], buf_fds, sizeof(buf_fds));
+            atomic_fetch_add(&client->metrics.fds, nfd);
+            if (td->slot == nslots - 1) {
+                // One reference for client->buffer, one for client->current
+                pending->nslots = nslots;
+                pending->seq = ++client->buffer_seq;
+                atomic_store(&pending->refs, 2);
+                buffer_retire(atomic_exchange(&client->buffer, pending));
+                buffer_release(client->current);
+                client->current = pending;
+                client->pending = NULL;
+                atomic_fetch_add(&client->metrics.buffers, 1);
+            }
+        } else if (buf[0] == CAPTURE_FRAME_DATA_TYPE) {
+            const struct capture_frame_data *fd = (const struct capture_frame_data *)buf;
+
+            int fence = -1;
+            struct cmsghdr *cmsgh = CMSG_FIRSTHDR(&msg);
+            if (cmsgh && cmsgh->cmsg_level == SOL_SOCKET && cmsgh->cmsg_type == SCM_RIGHTS) {
+                fence = ((int*)CMSG_DATA(cmsgh))[0];
+            }
+
+            if (n != CAPTURE_FRAME_DATA_SIZE || fd->slot >= CAPTURE_MAX_SLOTS) {
+                if (fence >= 0) {
+                    close(fence);
+                }
+                client->closed = true;
+                return;
+            }
+            if (client->current) {
+                // Damage first, upload starts once it sees the new timestamp
+                if (!fd->has_damage) {
+                    damage_rows_add(&client->current->damage_rows[fd->slot], 0, DAMAGE_ROWS_ALL);
+                } else if (fd->damage_width) {
+                    damage_rows_add(&client->current->damage_rows[fd->slot],
+                        fd->damage_y, fd->damage_y + fd->damage_height);
+                }
+                atomic_store(&client->current->timestamps[fd->slot], fd->timestamp);
+                // Unwaited fence of the previous frame in this slot is signaled by now
+                fence = atomic_exchange(&client->current->fences[fd->slot], fence);
+            }
+            if (fence >= 0) {
+                close(fence);
+            }
+            atomic_fetch_add(&client->metrics.frames, 1);
+        } else {
+            // Unknown messages are ignored, but not their fds
+            server_close_fds(&msg);
+        }
+    }
+}
 
-    if (client->map_memory) {
-        munmap(client->map_memory, client->map_size);
-        client->map_memory = NULL;
+static int server_bind_socket()
+{
+    int sockfd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (sockfd < 0) {
+        blog(LOG_ERROR, "Cannot create unix socket: %s", strerror(errno));
+        return -1;
     }
 
-    for (int i = 0; i < 4; ++i) {
-        if (client->buf_fds[i] >= 0) {
-            close(client->buf_fds[i]);
-            client->buf_fds[i] = -1;
+    // Other OBS instances may already be capturing, use first free name
+    for (int i = 0; i < CAPTURE_MAX_CONSUMERS; ++i) {
+        char sockname[sizeof(((struct sockaddr_un*)0)->sun_path) - 1];
+        const int len = capture_socket_name(sockname, sizeof(sockname), i);
+        if (len <= 0 || len >= (int)sizeof(sockname)) {
+            blog(LOG_ERROR, "Invalid socket name");
+            break;
+        }
+
+        struct sockaddr_un addr;
+        addr.sun_family = PF_LOCAL;
+        addr.sun_path[0] = '\0'; // Abstract socket
+        memcpy(&addr.sun_path[1], sockname, len);
+
+        int ret = bind(sockfd, (const struct sockaddr *)&addr, sizeof(addr.sun_family) + 1 + len);
+        if (ret < 0) {
+            if (errno == EADDRINUSE) {
+                continue;
+            }
+            blog(LOG_ERROR, "Cannot bind unix socket to %s: %d", sockname, errno);
+            break;
         }
+
+        blog(LOG_INFO, "Listening on %s", sockname);
+        return sockfd;
     }
 
-    da_erase_item(server.clients, client);
+    if (errno == EADDRINUSE) {
+        blog(LOG_ERROR, "Cannot bind unix socket, all %d names in use", CAPTURE_MAX_CONSUMERS);
+    }
 
-    pthread_mutex_unlock(&server.mutex);
+    close(sockfd);
+    return -1;
 }
 
 static void *server_thread_run(void *data)
 {
-    const char sockname[] = "/com/obsproject/vkcapture";
-
-    int bufid = 0;
-    int clientid = 0;
-
-    da_init(server.fds);
     da_init(server.clients);
 
-    struct sockaddr_un addr;
-    addr.sun_family = PF_LOCAL;
-    addr.sun_path[0] = '\0'; // Abstract socket
-    memcpy(&addr.sun_path[1], sockname, sizeof(sockname) - 1);
+    server.epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (server.epollfd < 0) {
+        blog(LOG_ERROR, "Failed to create epoll: %s", strerror(errno));
+        return NULL;
+    }
 
-    int sockfd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
-    int ret = bind(sockfd, (const struct sockaddr *)&addr, sizeof(addr.sun_family) + sizeof(sockname));
-    if (ret < 0) {
-        blog(LOG_ERROR, "Cannot bind unix socket to %s: %d", addr.sun_path, errno);
+    server.sockfd = server_bind_socket();
+    if (server.sockfd < 0) {
+        close(server.epollfd);
         return NULL;
     }
 
-    ret = listen(sockfd, 1);
+    int ret = listen(server.sockfd, SOMAXCONN);
     if (ret < 0) {
-        blog(LOG_ERROR, "Cannot listen on unix socket bound to %s: %d", addr.sun_path, errno);
+        blog(LOG_ERROR, "Cannot listen on unix socket: %d", errno);
+        close(server.sockfd);
+        close(server.epollfd);
         return NULL;
     }
 
-    server_add_fd(sockfd, POLLIN);
-    server_add_fd(server.eventfd, POLLIN);
+    server.listen_watch.type = SERVER_WATCH_LISTEN;
+    server.event_watch.type = SERVER_WATCH_EVENT;
+    server_watch_fd(server.sockfd, &server.listen_watch);
+    server_watch_fd(server.eventfd, &server.event_watch);
+
+    struct epoll_event events[SERVER_MAX_EVENTS];
 
     while (true) {
-        int ret = poll(server.fds.array, server.fds.num, -1);
-        if (ret <= 0) {
+        int nevents = epoll_wait(server.epollfd, events, SERVER_MAX_EVENTS, -1);
+        if (nevents <= 0) {
             continue;
         }
 
-        if (server_has_event_on_fd(server.eventfd)) {
-            uint64_t q;
-            if (read(server.eventfd, &q, sizeof(q)) != sizeof(q)) {
-                blog(LOG_ERROR, "Failed to read from eventfd %s", strerror(errno));
+        bool quit = false;
+        bool cleanup = false;
+
+        for (int i = 0; i < nevents; ++i) {
+            struct server_watch *watch = events[i].data.ptr;
+            switch (watch->type) {
+            case SERVER_WATCH_EVENT: {
+                uint64_t q;
+                if (read(server.eventfd, &q, sizeof(q)) != sizeof(q)) {
+                    blog(LOG_ERROR, "Failed to read from eventfd %s", strerror(errno));
+                }
+                quit = server.quit;
+                cleanup = true;
+                break;
             }
-            if (server.quit) {
+            case SERVER_WATCH_LISTEN:
+                server_accept();
+                break;
+            case SERVER_WATCH_CLIENT:
+                server_read_client(watch->client);
+                cleanup |= watch->client->closed;
+                break;
+            case SERVER_WATCH_CLIENT_PID:
+                blog(LOG_INFO, "Client %d process exited", watch->client->id);
+                watch->client->closed = true;
+                cleanup = true;
                 break;
             }
         }
 
-        if (server_has_event_on_fd(sockfd)) {
-            int clientfd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
-            if (clientfd >= 0) {
-                vkcapture_client_t client = {0};
-                memset(&client.buf_fds, -1, sizeof(client.buf_fds));
-                client.id = ++clientid;
-                client.sockfd = clientfd;
-                pthread_mutex_lock(&server.mutex);
-                da_push_back(server.clients, &client);
-                pthread_mutex_unlock(&server.mutex);
-                server_add_fd(client.sockfd, POLLIN);
-                struct ucred cred = {0};
-                socklen_t cred_len = sizeof(cred);
-                if (getsockopt(client.sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0) {
-                    blog(LOG_WARNING, "Failed to get socket credentials: %s", strerror(errno));
-                }
-                blog(LOG_INFO, "Client %d connected (pid=%d)", client.id, cred.pid);
-            } else {
-                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
-                    blog(LOG_ERROR, "Cannot accept unix socket: %s", strerror(errno));
-                }
-            }
+        if (quit) {
+            break;
         }
 
-        for (size_t i = 0; i < server.clients.num; i++) {
-            vkcapture_client_t *client = server.clients.array + i;
-            if (client->unresponsive) {
-                server_cleanup_client(client);
-                continue;
-            }
-            if (!server_has_event_on_fd(client->sockfd)) {
-                continue;
-            }
-
-            uint8_t buf[CAPTURE_TEXTURE_DATA_SIZE];
-            struct msghdr msg = {0};
-            struct iovec io = {
-                .iov_base = buf,
-                .iov_len = CAPTURE_TEXTURE_DATA_SIZE,
-            };
-            msg.msg_iov = &io;
-            msg.msg_iovlen = 1;
-
-            char cmsg_buf[CMSG_SPACE(sizeof(int)) * 4];
-            msg.msg_control = cmsg_buf;
-            msg.msg_controllen = sizeof(cmsg_buf);
-
-            while (true) {
-                const ssize_t n = recvmsg(client->sockfd, &msg, MSG_NOSIGNAL);
-                if (n == -1) {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        break;
-                    }
-                    if (errno != ECONNRESET) {
-                        blog(LOG_ERROR, "Socket recv error: %s", strerror(errno));
-                    }
-                }
-                if (n <= 0) {
+        // Clients are only freed here, so no pending event points to freed client
+        if (cleanup) {
+            for (size_t i = 0; i < server.clients.num;) {
+                vkcapture_client_t *client = server.clients.array[i];
+                if (client->closed || client->unresponsive) {
                     server_cleanup_client(client);
-                    break;
-                }
-
-                if (buf[0] == CAPTURE_CLIENT_DATA_TYPE) {
-                    if (io.iov_len != CAPTURE_CLIENT_DATA_SIZE) {
-                        server_cleanup_client(client);
-                        break;
-                    }
-                    pthread_mutex_lock(&server.mutex);
-                    memcpy(&client->cdata, buf, CAPTURE_CLIENT_DATA_SIZE);
-                    pthread_mutex_unlock(&server.mutex);
-                    break;
-                } else if (buf[0] == CAPTURE_TEXTURE_DATA_TYPE) {
-                    pthread_mutex_lock(&server.mutex);
-                    memcpy(&client->tdata, buf, CAPTURE_TEXTURE_DATA_SIZE);
-                    pthread_mutex_unlock(&server.mutex);
-
-                    struct cmsghdr *cmsgh = CMSG_FIRSTHDR(&msg);
-                    if (!cmsgh || cmsgh->cmsg_level != SOL_SOCKET || cmsgh->cmsg_type != SCM_RIGHTS) {
-                        server_cleanup_client(client);
-                        break;
-                    }
-
-                    const size_t nfd = (cmsgh->cmsg_len - sizeof(struct cmsghdr)) / sizeof(int);
-
-                    int buf_fds[4] = {-1, -1, -1, -1};
-                    for (size_t i = 0; i < nfd; ++i) {
-                        buf_fds[i] = ((int*)CMSG_DATA(cmsgh))[i];
-                    }
-
-                    if (io.iov_len != CAPTURE_TEXTURE_DATA_SIZE || client->tdata.nfd != nfd) {
-                        for (size_t i = 0; i < nfd; ++i) {
-                            close(buf_fds[i]);
-                        }
-                        server_cleanup_client(client);
-                        break;
-                    }
-
-                    pthread_mutex_lock(&server.mutex);
-                    for (int i = 0; i < 4; ++i) {
-                        if (client->buf_fds[i] >= 0) {
-                            close(client->buf_fds[i]);
-                        }
-                        client->buf_fds[i] = buf_fds[i];
-                    }
-                    client->buf_id = ++bufid;
-                    pthread_mutex_unlock(&server.mutex);
+                } else {
+                    i++;
                 }
             }
         }
     }
 
     while (server.clients.num) {
-        server_cleanup_client(server.clients.array);
+        server_cleanup_client(server.clients.array[0]);
     }
 
-    close(sockfd);
+    close(server.sockfd);
+    close(server.epollfd);
 
     da_free(server.clients);
-    da_free(server.fds);
 
     return NULL;
 }
 
+static int64_t metrics_value(void *metrics, const struct metric_desc *desc)
+{
+    return atomic_load((_Atomic int64_t *)((uint8_t *)metrics + desc->offset));
+}
+
+static void metrics_set(obs_data_t *item, void *metrics, const struct metric_desc *descs, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        obs_data_set_int(item, descs[i].name, metrics_value(metrics, &descs[i]));
+    }
+}
+
+static void metrics_family(struct dstr *om, const char *prefix, const struct metric_desc *desc)
+{
+    dstr_catf(om, "# TYPE vkcapture_%s_%s %s\n", prefix, desc->name, desc->type);
+    dstr_catf(om, "# HELP vkcapture_%s_%s %s\n", prefix, desc->name, desc->help);
+}
+
+static void metrics_sample(struct dstr *om, const char *prefix, const struct metric_desc *desc,
+    const char *label, const char *value, int64_t metric)
+{
+    dstr_catf(om, "vkcapture_%s_%s%s{%s=\"", prefix, desc->name,
+        strcmp(desc->type, "counter") ? "" : "_total", label);
+    for (const char *c = value; *c; ++c) {
+        if (*c == '\n') {
+            dstr_cat(om, "\\n");
+            continue;
+        }
+        if (*c == '"' || *c == '\\') {
+            dstr_cat_ch(om, '\\');
+        }
+        dstr_cat_ch(om, *c);
+    }
+    dstr_catf(om, "\"} %" PRId64 "\n", metric);
+}
+
+static void metrics_proc(void *data, calldata_t *cd)
+{
+    UNUSED_PARAMETER(data);
+
+    const size_t client_count = sizeof(client_metric_descs) / sizeof(client_metric_descs[0]);
+    const size_t source_count = sizeof(source_metric_descs) / sizeof(source_metric_descs[0]);
+
+    obs_data_array_t *clients = obs_data_array_create();
+    obs_data_array_t *srcs = obs_data_array_create();
+    struct dstr om = {0};
+    struct dstr label = {0};
+
+    pthread_mutex_lock(&server.mutex);
+
+    for (size_t i = 0; i < server.clients.num; ++i) {
+        vkcapture_client_t *client = server.clients.array[i];
+        obs_data_t *item = obs_data_create();
+        obs_data_set_int(item, "id", client->id);
+        dstr_printf(&label, "%.*s", (int)sizeof(client->cdata.exe), client->cdata.exe);
+        obs_data_set_string(item, "exe", label.array);
+        metrics_set(item, &client->metrics, client_metric_descs, client_count);
+        obs_data_array_push_back(clients, item);
+        obs_data_release(item);
+    }
+
+    for (size_t i = 0; i < sources.num; ++i) {
+        vkcapture_source_t *ctx = sources.array[i];
+        obs_data_t *item = obs_data_create();
+        obs_data_set_string(item, "name", obs_source_get_name(ctx->source));
+        metrics_set(item, &ctx->metrics, source_metric_descs, source_count);
+        obs_data_array_push_back(srcs, item);
+        obs_data_release(item);
+    }
+
+    // Client id is the label, exe names are not unique
+    for (size_t d = 0; d < client_count; ++d) {
+        metrics_family(&om, "client", &client_metric_descs[d]);
+        for (size_t i = 0; i < server.clients.num; ++i) {
+            vkcapture_client_t *client = server.clients.array[i];
+            dstr_printf(&label, "%d", client->id);
+            metrics_sample(&om, "client", &client_metric_descs[d], "client", label.array,
+                metrics_value(&client->metrics, &client_metric_descs[d]));
+        }
+    }
+
+    for (size_t d = 0; d < source_count; ++d) {
+        metrics_family(&om, "source", &source_metric_descs[d]);
+        for (size_t i = 0; i < sources.num; ++i) {
+            vkcapture_source_t *ctx = sources.array[i];
+            metrics_sample(&om, "source", &source_metric_descs[d], "source",
+                obs_source_get_name(ctx->source),
+                metrics_value(&ctx->metrics, &source_metric_descs[d]));
+        }
+    }
+
+    pthread_mutex_unlock(&server.mutex);
+
+    dstr_cat(&om, "# EOF\n");
+
+    obs_data_t *root = obs_data_create();
+    obs_data_set_array(root, "clients", clients);
+    obs_data_set_array(root, "sources", srcs);
+    calldata_set_string(cd, "json", obs_data_get_json(root));
+    calldata_set_string(cd, "openmetrics", om.array);
+
+    obs_data_release(root);
+    obs_data_array_release(clients);
+    obs_data_array_release(srcs);
+    dstr_free(&om);
+    dstr_free(&label);
+}
+
 bool obs_module_load(void)
 {
     enum obs_nix_platform_type platform = obs_get_nix_platform();
@@ -954,7 +2419,21 @@ bool obs_module_load(void)
         return false;
     }
 
+    char *config_dir = obs_module_config_path("");
+    if (config_dir) {
+        os_mkdirs(config_dir);
+        bfree(config_dir);
+    }
+    import_cache_path = obs_module_config_path("import_cache.json");
+    if (import_cache_path) {
+        import_cache = obs_data_create_from_json_file_safe(import_cache_path, "bak");
+        if (!import_cache) {
+            import_cache = obs_data_create();
+        }
+    }
+
     pthread_mutex_init(&server.mutex, NULL);
+    pthread_mutex_init(&texture_cache.mutex, NULL);
     if (pthread_create(&server.thread, NULL, server_thread_run, NULL) != 0) {
         blog(LOG_ERROR, "Failed to create thread");
         return false;
@@ -962,6 +2441,9 @@ bool obs_module_load(void)
     pthread_setname_np(server.thread, PLUGIN_NAME);
 
     obs_register_source(&vkcapture_input);
+
+    proc_handler_t *ph = obs_get_proc_handler();
+    proc_handler_add(ph, "void vkcapture_metrics(out string json, out string openmetrics)", metrics_proc, NULL);
     blog(LOG_INFO, "plugin loaded successfully (version %s)", PLUGIN_VERSION);
 
     return true;
@@ -974,6 +2456,17 @@ void obs_module_unload()
         pthread_join(server.thread, NULL);
     }
 
+    // Sources are gone, nothing references the buffers anymore
+    buffers_collect();
+
+    da_free(dmabuf_modifiers);
+
+    obs_data_release(import_cache);
+    bfree(import_cache_path);
+
+    da_free(texture_cache.textures);
+    pthread_mutex_destroy(&texture_cache.mutex);
+
     blog(LOG_INFO, "plugin unloaded");
 }
 
@@ -58,6 +58,12 @@ struct vk_obj_list {
     pthread_mutex_t mutex;
 };
 
+struct vk_export_image {
+    VkImage image;
+    VkDeviceMemory mem;
+    struct capture_buffer buf;
+};
+
 struct vk_swap_data {
     struct vk_obj_node node;
 
@@ -65,17 +71,14 @@ struct vk_swap_data {
     VkFormat format;
     VkColorSpaceKHR color_space;
     uint64_t winid;
-    VkImage export_image;
+    VkRect2D export_region;
     VkFormat export_format;
-    VkDeviceMemory export_mem;
+    struct vk_export_image exports[CAPTURE_MAX_SLOTS];
+    uint32_t export_count;
+    uint32_t export_index;
     VkImage *swap_images;
     uint32_t image_count;
 
-    int dmabuf_nfd;
-    int dmabuf_fds[4];
-    int dmabuf_strides[4];
-    int dmabuf_offsets[4];
-    uint64_t dmabuf_modifier;
     bool captured;
 };
 
@@ -120,6 +123,7 @@ struct vk_data {
     VkDevice device;
     VkDriverId driver_id;
     uint8_t device_uuid[16];
+    uint8_t driver_uuid[16];
 
     bool valid;
 
@@ -428,24 +432,29 @@ static void vk_shtex_free(struct vk_data *data)
 
     while (swap) {
         VkDevice device = data->device;
-        if (swap->export_image)
-            data->funcs.DestroyImage(device, swap->export_image,
-                    data->ac);
-
-        swap->dmabuf_nfd = 0;
-        for (int i = 0; i < 4; ++i) {
-            if (swap->dmabuf_fds[i] >= 0) {
-                close(swap->dmabuf_fds[i]);
-                swap->dmabuf_fds[i] = -1;
+        for (uint32_t i = 0; i < swap->export_count; ++i) {
+            struct vk_export_image *exp = &swap->exports[i];
+            if (exp->image)
+                data->funcs.DestroyImage(device, exp->image,
+                        data->ac);
+
+            exp->buf.nfd = 0;
+            for (int j = 0; j < 4; ++j) {
+                if (exp->buf.fds[j] >= 0) {
+                    close(exp->buf.fds[j]);
+                    exp->buf.fds[j] = -1;
+                }
             }
-        }
 
-        if (swap->export_mem)
-            data->funcs.FreeMemory(device, swap->export_mem, NULL);
+            if (exp->mem)
+                data->funcs.FreeMemory(device, exp->mem, NULL);
 
-        swap->export_mem = VK_NULL_HANDLE;
-        swap->export_image = VK_NULL_HANDLE;
+            exp->mem = VK_NULL_HANDLE;
+            exp->image = VK_NULL_HANDLE;
+        }
 
+        swap->export_count = 0;
+        swap->export_index = 0;
         swap->captured = false;
 
         swap = swap_walk_next(swap);
@@ -606,150 +615,29 @@ static uint32_t vk_color_space_to_obs(VkColorSpaceKHR vk)
     }
 }
 
-static inline bool vk_shtex_init_vulkan_tex(struct vk_data *data,
-        struct vk_swap_data *swap)
+static bool vk_shtex_create_export_image(struct vk_data *data,
+        const VkImageCreateInfo *img_info, bool use_modifiers,
+        bool same_device, bool map_host,
+        const struct VkDrmFormatModifierPropertiesEXT *modifier_props,
+        uint32_t modifier_prop_count, struct vk_export_image *exp)
 {
     struct vk_device_funcs *funcs = &data->funcs;
     struct vk_inst_funcs *ifuncs =
         get_inst_funcs_by_physical_device(data->phy_device);
 
-    const bool no_modifiers = capture_allocate_no_modifiers();
-    const bool linear = vkcapture_linear || capture_allocate_linear();
-    const bool map_host = capture_allocate_map_host();
-    const bool same_device = capture_compare_device_uuid(data->device_uuid);
-
-    hlog("Texture %s %ux%u", vk_format_to_str(swap->format), swap->image_extent.width, swap->image_extent.height);
-
-    if (vk_format_to_drm(swap->format) != -1) {
-        swap->export_format = swap->format;
-    } else {
-        swap->export_format = VK_FORMAT_B8G8R8A8_UNORM;
-        hlog("Converting to %s", vk_format_to_str(swap->export_format));
-    }
-
-    if (!same_device) {
-        hlog("OBS is running on different GPU");
-    }
-
-    VkExternalMemoryImageCreateInfo ext_mem_image_info = {};
-    ext_mem_image_info.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
-    ext_mem_image_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
-
-    VkImageCreateInfo img_info = {};
-    img_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    img_info.pNext = &ext_mem_image_info;
-    img_info.imageType = VK_IMAGE_TYPE_2D;
-    img_info.format = swap->export_format;
-    img_info.mipLevels = 1;
-    img_info.arrayLayers = 1;
-    img_info.samples = VK_SAMPLE_COUNT_1_BIT;
-    img_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    img_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    img_info.extent.width = swap->image_extent.width;
-    img_info.extent.height = swap->image_extent.height;
-    img_info.extent.depth = 1;
-    img_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-    img_info.tiling = VK_IMAGE_TILING_LINEAR;
-
     int num_planes = 1;
-    uint64_t *image_modifiers = NULL;
-    VkImageDrmFormatModifierListCreateInfoEXT image_modifier_list = {};
-    struct VkDrmFormatModifierPropertiesEXT *modifier_props = NULL;
-    uint32_t modifier_prop_count = 0;
-
-    if (!no_modifiers && funcs->GetImageDrmFormatModifierPropertiesEXT) {
-        VkDrmFormatModifierPropertiesListEXT modifier_props_list = {};
-        modifier_props_list.sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT;
-
-        VkFormatProperties2KHR format_props = {};
-        format_props.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
-        format_props.pNext = &modifier_props_list;
-
-        ifuncs->GetPhysicalDeviceFormatProperties2KHR(data->phy_device,
-                img_info.format, &format_props);
-
-        modifier_props =
-            vk_alloc(data->ac, modifier_props_list.drmFormatModifierCount * sizeof(struct VkDrmFormatModifierPropertiesEXT),
-                    _Alignof(struct VkDrmFormatModifierPropertiesEXT), VK_SYSTEM_ALLOCATION_SCOPE_COMMAND);
-
-        modifier_props_list.pDrmFormatModifierProperties = modifier_props;
-
-        ifuncs->GetPhysicalDeviceFormatProperties2KHR(data->phy_device,
-                img_info.format, &format_props);
-
-#ifndef NDEBUG
-        hlog("Available modifiers:");
-#endif
-        for (uint32_t i = 0; i < modifier_props_list.drmFormatModifierCount; i++) {
-            if (linear && modifier_props[i].drmFormatModifier != DRM_FORMAT_MOD_LINEAR) {
-                continue;
-            }
-            if (!allow_modifier(data, modifier_props[i].drmFormatModifier)) {
-                continue;
-            }
-
-            VkPhysicalDeviceImageDrmFormatModifierInfoEXT mod_info = {};
-            mod_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT;
-            mod_info.drmFormatModifier = modifier_props[i].drmFormatModifier;
-            mod_info.sharingMode = img_info.sharingMode;
-
-            VkPhysicalDeviceImageFormatInfo2 format_info = {};
-            format_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
-            format_info.pNext = &mod_info;
-            format_info.format = img_info.format;
-            format_info.type = VK_IMAGE_TYPE_2D;
-            format_info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
-            format_info.usage = img_info.usage;
-            format_info.flags = img_info.flags;
-
-            VkImageFormatProperties2KHR format_props = {};
-            format_props.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
-            format_props.pNext = NULL;
-
-            VkResult result = ifuncs->GetPhysicalDeviceImageFormatProperties2KHR(data->phy_device,
-                    &format_info, &format_props);
-            if (result == VK_SUCCESS) {
-#ifndef NDEBUG
-                hlog(" %d: modifier:%"PRIu64" planes:%d", i,
-                        modifier_props[i].drmFormatModifier,
-                        modifier_props[i].drmFormatModifierPlaneCount);
-#endif
-                modifier_props[modifier_prop_count++] = modifier_props[i];
-            }
-        }
-
-        if (modifier_prop_count > 0) {
-            image_modifiers =
-                vk_alloc(data->ac, sizeof(uint64_t) * modifier_prop_count,
-                        _Alignof(uint64_t), VK_SYSTEM_ALLOCATION_SCOPE_COMMAND);
-
-            for (uint32_t i = 0; i < modifier_prop_count; ++i) {
-                image_modifiers[i] = modifier_props[i].drmFormatModifier;
-            }
-
-            image_modifier_list.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_LIST_CREATE_INFO_EXT;
-            image_modifier_list.drmFormatModifierCount = modifier_prop_count;
-            image_modifier_list.pDrmFormatModifiers = image_modifiers;
-            img_info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
-            ext_mem_image_info.pNext = &image_modifier_list;
-        } else {
-            hlog("No suitable DRM modifier found!");
-        }
-    }
-
     VkDevice device = data->device;
 
     VkResult res;
-    res = funcs->CreateImage(device, &img_info, data->ac, &swap->export_image);
-    vk_free(data->ac, image_modifiers);
+    res = funcs->CreateImage(device, img_info, data->ac, &exp->image);
     if (VK_SUCCESS != res) {
         hlog("Failed to CreateImage %s", result_to_str(res));
-        swap->export_image = VK_NULL_HANDLE;
+        exp->image = VK_NULL_HANDLE;
         return false;
     }
 
     VkImageMemoryRequirementsInfo2 memri = {};
-    memri.image = swap->export_image;
+    memri.image = exp->image;
     memri.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
 
     VkMemoryDedicatedRequirements mdr = {};
@@ -774,7 +662,7 @@ static inline bool vk_shtex_init_vulkan_tex(struct vk_data *data,
     VkMemoryDedicatedAllocateInfo memory_dedicated_info = {};
     memory_dedicated_info.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
     memory_dedicated_info.pNext = &memory_export_info;
-    memory_dedicated_info.image = swap->export_image;
+    memory_dedicated_info.image = exp->image;
 
     VkMemoryAllocateInfo memi = {};
     memi.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
@@ -791,7 +679,7 @@ static inline bool vk_shtex_init_vulkan_tex(struct vk_data *data,
                 (pdmp.memoryTypes[i].propertyFlags &
                  mem_req_bits) == mem_req_bits) {
             memi.memoryTypeIndex = i;
-            res = funcs->AllocateMemory(device, &memi, NULL, &swap->export_mem);
+            res = funcs->AllocateMemory(device, &memi, NULL, &exp->mem);
             allocated = res == VK_SUCCESS;
             if (allocated)
                 break;
@@ -805,7 +693,7 @@ static inline bool vk_shtex_init_vulkan_tex(struct vk_data *data,
                     (pdmp.memoryTypes[i].propertyFlags &
                      mem_req_bits) != mem_req_bits) {
                 memi.memoryTypeIndex = i;
-                res = funcs->AllocateMemory(device, &memi, NULL, &swap->export_mem);
+                res = funcs->AllocateMemory(device, &memi, NULL, &exp->mem);
                 allocated = res == VK_SUCCESS;
                 if (allocated)
                     break;
@@ -816,61 +704,60 @@ static inline bool vk_shtex_init_vulkan_tex(struct vk_data *data,
 
     if (!allocated) {
         hlog("Failed to allocate memory of any type");
-        funcs->DestroyImage(device, swap->export_image, data->ac);
-        swap->export_image = VK_NULL_HANDLE;
+        funcs->DestroyImage(device, exp->image, data->ac);
+        exp->image = VK_NULL_HANDLE;
         return false;
     }
 
     VkBindImageMemoryInfo bimi = {};
     bimi.sType = VK_STRUCTURE_TYPE_BIND_IMAGE_MEMORY_INFO;
-    bimi.image = swap->export_image;
-    bimi.memory = swap->export_mem;
+    bimi.image = exp->image;
+    bimi.memory = exp->mem;
     bimi.memoryOffset = 0;
     res = funcs->BindImageMemory2KHR(device, 1, &bimi);
     if (VK_SUCCESS != res) {
         hlog("BindImageMemory2KHR failed %s", result_to_str(res));
-        funcs->DestroyImage(device, swap->export_image, data->ac);
-        swap->export_image = VK_NULL_HANDLE;
+        funcs->DestroyImage(device, exp->image, data->ac);
+        exp->image = VK_NULL_HANDLE;
         return false;
     }
 
     int fd = -1;
     VkMemoryGetFdInfoKHR gfdi = {};
     gfdi.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR;
-    gfdi.memory = swap->export_mem;
+    gfdi.memory = exp->mem;
     gfdi.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
     res = funcs->GetMemoryFdKHR(device, &gfdi, &fd);
     if (VK_SUCCESS != res) {
         hlog("GetMemoryFdKHR failed %s", result_to_str(res));
-        funcs->DestroyImage(device, swap->export_image, data->ac);
-        swap->export_image = VK_NULL_HANDLE;
+        funcs->DestroyImage(device, exp->image, data->ac);
+        exp->image = VK_NULL_HANDLE;
         return false;
     }
 
-    if (!no_modifiers && funcs->GetImageDrmFormatModifierPropertiesEXT) {
+    if (use_modifiers) {
         VkImageDrmFormatModifierPropertiesEXT image_mod_props = {};
         image_mod_props.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_PROPERTIES_EXT;
-        res = funcs->GetImageDrmFormatModifierPropertiesEXT(device, swap->export_image, &image_mod_props);
+        res = funcs->GetImageDrmFormatModifierPropertiesEXT(device, exp->image, &image_mod_props);
         if (VK_SUCCESS != res) {
             hlog("GetImageDrmFormatModifierPropertiesEXT failed %s", result_to_str(res));
-            swap->dmabuf_modifier = DRM_FORMAT_MOD_INVALID;
+            exp->buf.modifier = DRM_FORMAT_MOD_INVALID;
         } else {
-            swap->dmabuf_modifier = image_mod_props.drmFormatModifier;
+            exp->buf.modifier = image_mod_props.drmFormatModifier;
             for (uint32_t i = 0; i < modifier_prop_count; ++i) {
-                if (modifier_props[i].drmFormatModifier == swap->dmabuf_modifier) {
+                if (modifier_props[i].drmFormatModifier == exp->buf.modifier) {
                     num_planes = modifier_props[i].drmFormatModifierPlaneCount;
                     break;
                 }
             }
         }
-        vk_free(data->ac, modifier_props);
     } else {
-        swap->dmabuf_modifier = DRM_FORMAT_MOD_INVALID;
+        exp->buf.modifier = DRM_FORMAT_MOD_INVALID;
     }
 
     for (int i = 0; i < num_planes; i++) {
         VkImageSubresource sbr = {};
-        if (!no_modifiers && funcs->GetImageDrmFormatModifierPropertiesEXT) {
+        if (use_modifiers) {
             sbr.aspectMask = VK_IMAGE_ASPECT_MEMORY_PLANE_0_BIT_EXT << i;
         } else {
             sbr.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -878,24 +765,188 @@ static inline bool vk_shtex_init_vulkan_tex(struct vk_data *data,
         sbr.mipLevel = 0;
         sbr.arrayLayer = 0;
         VkSubresourceLayout layout;
-        funcs->GetImageSubresourceLayout(device, swap->export_image, &sbr, &layout);
+        funcs->GetImageSubresourceLayout(device, exp->image, &sbr, &layout);
 
-        swap->dmabuf_fds[i] = i == 0 ? fd : os_dupfd_cloexec(fd);
-        swap->dmabuf_strides[i] = layout.rowPitch;
-        swap->dmabuf_offsets[i] = layout.offset;
+        exp->buf.fds[i] = i == 0 ? fd : os_dupfd_cloexec(fd);
+        exp->buf.strides[i] = layout.rowPitch;
+        exp->buf.offsets[i] = layout.offset;
     }
-    swap->dmabuf_nfd = num_planes;
+    exp->buf.nfd = num_planes;
 
 #ifndef NDEBUG
-    hlog("Got planes %d fd %d", swap->dmabuf_nfd, swap->dmabuf_fds[0]);
-    if (swap->dmabuf_modifier != DRM_FORMAT_MOD_INVALID) {
-        hlog("Got modifier %"PRIu64, swap->dmabuf_modifier);
+    hlog("Got planes %d fd %d", exp->buf.nfd, exp->buf.fds[0]);
+    if (exp->buf.modifier != DRM_FORMAT_MOD_INVALID) {
+        hlog("Got modifier %"PRIu64, exp->buf.modifier);
     }
 #endif
 
     return true;
 }
 
+static inline bool vk_shtex_init_vulkan_tex(struct vk_data *data,
+        struct vk_swap_data *swap)
+{
+    struct vk_device_funcs *funcs = &data->funcs;
+    struct vk_inst_funcs *ifuncs =
+        get_inst_funcs_by_physical_device(data->phy_device);
+
+    const bool no_modifiers = capture_allocate_no_modifiers();
+    const bool linear = vkcapture_linear || capture_allocate_linear();
+    const bool map_host = capture_allocate_map_host();
+    const bool same_device = capture_compare_device_uuid(data->device_uuid);
+
+    hlog("Texture %s %ux%u", vk_format_to_str(swap->format), swap->image_extent.width, swap->image_extent.height);
+
+    struct capture_region region;
+    capture_allocate_region(swap->image_extent.width, swap->image_extent.height, &region);
+    swap->export_region.offset.x = region.x;
+    swap->export_region.offset.y = region.y;
+    swap->export_region.extent.width = region.width;
+    swap->export_region.extent.height = region.height;
+    if (region.width != (int)swap->image_extent.width || region.height != (int)swap->image_extent.height) {
+        hlog("Region %d,%d %dx%d", region.x, region.y, region.width, region.height);
+    }
+
+    if (vk_format_to_drm(swap->format) != -1) {
+        swap->export_format = swap->format;
+    } else {
+        swap->export_format = VK_FORMAT_B8G8R8A8_UNORM;
+        hlog("Converting to %s", vk_format_to_str(swap->export_format));
+    }
+
+    if (!same_device) {
+        hlog("OBS is running on different GPU");
+    }
+
+    VkExternalMemoryImageCreateInfo ext_mem_image_info = {};
+    ext_mem_image_info.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
+    ext_mem_image_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+
+    VkImageCreateInfo img_info = {};
+    img_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    img_info.pNext = &ext_mem_image_info;
+    img_info.imageType = VK_IMAGE_TYPE_2D;
+    img_info.format = swap->export_format;
+    img_info.mipLevels = 1;
+    img_info.arrayLayers = 1;
+    img_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    img_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    img_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    img_info.extent.width = swap->export_region.extent.width;
+    img_info.extent.height = swap->export_region.extent.height;
+    img_info.extent.depth = 1;
+    img_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    img_info.tiling = VK_IMAGE_TILING_LINEAR;
+
+    bool use_modifiers = !no_modifiers && funcs->GetImageDrmFormatModifierPropertiesEXT;
+    const uint32_t drm_format = vk_format_to_drm(swap->export_format);
+    uint64_t *image_modifiers = NULL;
+    VkImageDrmFormatModifierListCreateInfoEXT image_modifier_list = {};
+    struct VkDrmFormatModifierPropertiesEXT *modifier_props = NULL;
+    uint32_t modifier_prop_count = 0;
+
+    if (use_modifiers) {
+        VkDrmFormatModifierPropertiesListEXT modifier_props_list = {};
+        modifier_props_list.sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT;
+
+        VkFormatProperties2KHR format_props = {};
+        format_props.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
+        format_props.pNext = &modifier_props_list;
+
+        ifuncs->GetPhysicalDeviceFormatProperties2KHR(data->phy_device,
+                img_info.format, &format_props);
+
+        modifier_props =
+            vk_alloc(data->ac, modifier_props_list.drmFormatModifierCount * sizeof(struct VkDrmFormatModifierPropertiesEXT),
+                    _Alignof(struct VkDrmFormatModifierPropertiesEXT), VK_SYSTEM_ALLOCATION_SCOPE_COMMAND);
+
+        modifier_props_list.pDrmFormatModifierProperties = modifier_props;
+
+        ifuncs->GetPhysicalDeviceFormatProperties2KHR(data->phy_device,
+                img_info.format, &format_props);
+
+#ifndef NDEBUG
+        hlog("Available modifiers:");
+#endif
+        for (uint32_t i = 0; i < modifier_props_list.drmFormatModifierCount; i++) {
+            if (linear && modifier_props[i].drmFormatModifier != DRM_FORMAT_MOD_LINEAR) {
+                continue;
+            }
+            if (!allow_modifier(data, modifier_props[i].drmFormatModifier)) {
+                continue;
+            }
+            if (!capture_allocate_modifier(drm_format, modifier_props[i].drmFormatModifier)) {
+                continue;
+            }
+
+            VkPhysicalDeviceImageDrmFormatModifierInfoEXT mod_info = {};
+            mod_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT;
+            mod_info.drmFormatModifier = modifier_props[i].drmFormatModifier;
+            mod_info.sharingMode = img_info.sharingMode;
+
+            VkPhysicalDeviceImageFormatInfo2 format_info = {};
+            format_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
+            format_info.pNext = &mod_info;
+            format_info.format = img_info.format;
+            format_info.type = VK_IMAGE_TYPE_2D;
+            format_info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+            format_info.usage = img_info.usage;
+            format_info.flags = img_info.flags;
+
+            VkImageFormatProperties2KHR format_props = {};
+            format_props.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
+            format_props.pNext = NULL;
+
+            VkResult result = ifuncs->GetPhysicalDeviceImageFormatProperties2KHR(data->phy_device,
+                    &format_info, &format_props);
+            if (result == VK_SUCCESS) {
+#ifndef NDEBUG
+                hlog(" %d: modifier:%"PRIu64" planes:%d", i,
+                        modifier_props[i].drmFormatModifier,
+                        modifier_props[i].drmFormatModifierPlaneCount);
+#endif
+                modifier_props[modifier_prop_count++] = modifier_props[i];
+            }
+        }
+
+        if (modifier_prop_count > 0) {
+            image_modifiers =
+                vk_alloc(data->ac, sizeof(uint64_t) * modifier_prop_count,
+                        _Alignof(uint64_t), VK_SYSTEM_ALLOCATION_SCOPE_COMMAND);
+
+            for (uint32_t i = 0; i < modifier_prop_count; ++i) {
+                image_modifiers[i] = modifier_props[i].drmFormatModifier;
+            }
+
+            image_modifier_list.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_LIST_CREATE_INFO_EXT;
+            image_modifier_list.drmFormatModifierCount = modifier_prop_count;
+            image_modifier_list.pDrmFormatModifiers = image_modifiers;
+            img_info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+            ext_mem_image_info.pNext = &image_modifier_list;
+        } else {
+            hlog("No suitable DRM modifier found!");
+        }
+        // Image falls back to LINEAR tiling, planes are queried by color aspect
+        use_modifiers = modifier_prop_count > 0;
+    }
+
+    const int nslots = capture_allocate_ring_size();
+    bool created = true;
+    for (int i = 0; i < nslots && created; ++i) {
+        swap->export_count = i + 1;
+        created = vk_shtex_create_export_image(data, &img_info, use_modifiers,
+                same_device, map_host, modifier_props, modifier_prop_count,
+                &swap->exports[i]);
+    }
+    vk_free(data->ac, image_modifiers);
+    vk_free(data->ac, modifier_props);
+
+    if (created && nslots > 1) {
+        hlog("Using %d images", nslots);
+    }
+    return created;
+}
+
 static bool vk_shtex_init(struct vk_data *data, struct vk_swap_data *swap)
 {
     if (!vk_shtex_init_vulkan_tex(data, swap)) {
@@ -904,11 +955,15 @@ static bool vk_shtex_init(struct vk_data *data, struct vk_swap_data *swap)
 
     data->cur_swap = swap;
 
-    capture_init_shtex(swap->image_extent.width, swap->image_extent.height,
+    struct capture_buffer buffers[CAPTURE_MAX_SLOTS];
+    for (uint32_t i = 0; i < swap->export_count; ++i) {
+        buffers[i] = swap->exports[i].buf;
+    }
+
+    capture_init_shtex_ring(swap->export_region.extent.width, swap->export_region.extent.height,
         vk_format_to_drm(swap->export_format),
-        swap->dmabuf_strides, swap->dmabuf_offsets, swap->dmabuf_modifier,
         swap->winid, /*flip*/false, vk_color_space_to_obs(swap->color_space),
-        swap->dmabuf_nfd, swap->dmabuf_fds);
+        swap->export_count, buffers);
 
     hlog("------------------ vulkan capture started ------------------");
     return true;
@@ -1101,7 +1156,7 @@ static void vk_shtex_capture(struct vk_data *data,
     dst_mb->newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
     dst_mb->srcQueueFamilyIndex = VK_QUEUE_FAMILY_EXTERNAL;
     dst_mb->dstQueueFamilyIndex = fam_idx;
-    dst_mb->image = swap->export_image;
+    dst_mb->image = swap->exports[swap->export_index].image;
     dst_mb->subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     dst_mb->subresourceRange.baseMipLevel = 0;
     dst_mb->subresourceRange.levelCount = 1;
@@ -1122,11 +1177,11 @@ static void vk_shtex_capture(struct vk_data *data,
         blt.srcSubresource.mipLevel = 0;
         blt.srcSubresource.baseArrayLayer = 0;
         blt.srcSubresource.layerCount = 1;
-        blt.srcOffsets[0].x = 0;
-        blt.srcOffsets[0].y = 0;
+        blt.srcOffsets[0].x = swap->export_region.offset.x;
+        blt.srcOffsets[0].y = swap->export_region.offset.y;
         blt.srcOffsets[0].z = 0;
-        blt.srcOffsets[1].x = swap->image_extent.width;
-        blt.srcOffsets[1].y = swap->image_extent.height;
+        blt.srcOffsets[1].x = swap->export_region.offset.x + swap->export_region.extent.width;
+        blt.srcOffsets[1].y = swap->export_region.offset.y + swap->export_region.extent.height;
         blt.srcOffsets[1].z = 1;
         blt.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
         blt.dstSubresource.mipLevel = 0;
@@ -1135,12 +1190,12 @@ static void vk_shtex_capture(struct vk_data *data,
         blt.dstOffsets[0].x = 0;
         blt.dstOffsets[0].y = 0;
         blt.dstOffsets[0].z = 0;
-        blt.dstOffsets[1].x = swap->image_extent.width;
-        blt.dstOffsets[1].y = swap->image_extent.height;
+        blt.dstOffsets[1].x = swap->export_region.extent.width;
+        blt.dstOffsets[1].y = swap->export_region.extent.height;
         blt.dstOffsets[1].z = 1;
         funcs->CmdBlitImage(cmd_buffer, cur_backbuffer,
                 VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                swap->export_image,
+                swap->exports[swap->export_index].image,
                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blt,
                 VK_FILTER_NEAREST);
     } else {
@@ -1149,8 +1204,8 @@ static void vk_shtex_capture(struct vk_data *data,
         cpy.srcSubresource.mipLevel = 0;
         cpy.srcSubresource.baseArrayLayer = 0;
         cpy.srcSubresource.layerCount = 1;
-        cpy.srcOffset.x = 0;
-        cpy.srcOffset.y = 0;
+        cpy.srcOffset.x = swap->export_region.offset.x;
+        cpy.srcOffset.y = swap->export_region.offset.y;
         cpy.srcOffset.z = 0;
         cpy.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
         cpy.dstSubresource.mipLevel = 0;
@@ -1159,12 +1214,12 @@ static void vk_shtex_capture(struct vk_data *data,
         cpy.dstOffset.x = 0;
         cpy.dstOffset.y = 0;
         cpy.dstOffset.z = 0;
-        cpy.extent.width = swap->image_extent.width;
-        cpy.extent.height = swap->image_extent.height;
+        cpy.extent.width = swap->export_region.extent.width;
+        cpy.extent.height = swap->export_region.extent.height;
         cpy.extent.depth = 1;
         funcs->CmdCopyImage(cmd_buffer, cur_backbuffer,
                 VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                swap->export_image,
+                swap->exports[swap->export_index].image,
                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &cpy);
     }
 
@@ -1240,6 +1295,7 @@ static void vk_capture(struct vk_data *data, VkQueue queue,
     // Use first swapchain ??
     struct vk_swap_data *swap = get_swap_data(data, info->pSwapchains[0]);
 
+    capture_set_device(data->device_uuid, data->driver_uuid);
     capture_update_socket();
 
     if (capture_should_stop()) {
@@ -1260,7 +1316,11 @@ static void vk_capture(struct vk_data *data, VkQueue queue,
             return;
         }
 
-        vk_shtex_capture(data, &data->funcs, swap, 0, queue, info);
+        if (capture_should_copy()) {
+            vk_shtex_capture(data, &data->funcs, swap, 0, queue, info);
+            capture_frame_copied(swap->export_index, -1, NULL);
+            swap->export_index = capture_next_slot(swap->export_index, swap->export_count);
+        }
     }
 }
 
@@ -1402,6 +1462,10 @@ static VkResult VKAPI_CALL OBS_CreateInstance(const VkInstanceCreateInfo *info,
 #undef GETADDR
 
     valid = valid && funcs_found;
+    if (info->pApplicationInfo && info->pApplicationInfo->pEngineName
+        && strcmp(info->pApplicationInfo->pEngineName, OBS_VKCAPTURE_GL_ENGINE_NAME) == 0) {
+        valid = false;
+    }
     idata->valid = valid;
 
     if (valid)
@@ -1696,6 +1760,7 @@ static VkResult VKAPI_CALL OBS_CreateDevice(VkPhysicalDevice phy_device,
 
     data->driver_id = propsDriver.driverID;
     memcpy(data->device_uuid, propsID.deviceUUID, 16);
+    memcpy(data->driver_uuid, propsID.driverUUID, 16);
 
     data->valid = true;
 
@@ -1774,11 +1839,15 @@ OBS_CreateSwapchainKHR(VkDevice device, const VkSwapchainCreateInfoKHR *cinfo,
             swap_data->format = cinfo->imageFormat;
             swap_data->color_space = cinfo->imageColorSpace;
             swap_data->winid = find_surf_winid(data->inst_data, cinfo->surface);
-            swap_data->export_image = VK_NULL_HANDLE;
-            swap_data->export_mem = VK_NULL_HANDLE;
             swap_data->image_count = count;
-            swap_data->dmabuf_nfd = 0;
-            memset(swap_data->dmabuf_fds, -1, sizeof(swap_data->dmabuf_fds));
+            swap_data->export_count = 0;
+            swap_data->export_index = 0;
+            for (int i = 0; i < CAPTURE_MAX_SLOTS; ++i) {
+                swap_data->exports[i].image = VK_NULL_HANDLE;
+                swap_data->exports[i].mem = VK_NULL_HANDLE;
+                swap_data->exports[i].buf.nfd = 0;
+                memset(swap_data->exports[i].buf.fds, -1, sizeof(swap_data->exports[i].buf.fds));
+            }
             swap_data->captured = false;
         }
     }
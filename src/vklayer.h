@@ -84,6 +84,9 @@ typedef struct VkImageDrmFormatModifierPropertiesEXT {
 typedef VkResult (VKAPI_PTR *PFN_vkGetImageDrmFormatModifierPropertiesEXT)(VkDevice device, VkImage image, VkImageDrmFormatModifierPropertiesEXT* pProperties);
 #endif
 
+// Engine name of the OpenGL interop instance, the layer doesn't capture it
+#define OBS_VKCAPTURE_GL_ENGINE_NAME "obs_glcapture"
+
 #define DEF_FUNC(x) PFN_vk##x x
 
 struct vk_inst_funcs {
@@ -16,53 +16,68 @@ You should have received a copy of the GNU General Public License along
 with this program. If not, see <https://www.gnu.org/licenses/>
 */
 
+#define _GNU_SOURCE
+
 #include "wlcursor.h"
 #include "capture.h"
 
 #include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
 
 struct output_data {
     wl_cursor_t *ctx;
     uint32_t id;
     struct wl_output *output;
-    struct wl_buffer *buffer;
+    // Compositor copies into buffers[back], render reads the other one
+    struct wl_buffer *buffers[2];
+    void *buffer_data[2];
+    int back;
     uint32_t buffer_width;
     uint32_t buffer_height;
     uint32_t buffer_stride;
-    void *buffer_data;
     struct ext_screencopy_session_v1 *session;
+    int32_t next_pos_x;
+    int32_t next_pos_y;
+    int32_t next_hotspot_x;
+    int32_t next_hotspot_y;
+    bool damaged;
+
+    // Published state, protected by ctx->mutex
+    int front;
+    uint64_t serial;
+    uint64_t hash;
     int32_t pos_x;
     int32_t pos_y;
     int32_t hotspot_x;
     int32_t hotspot_y;
-    bool damaged;
     bool have_cursor;
-    gs_texture_t *tex;
 };
 
 static void capture_output(struct output_data *data);
 
+// Must be called with ctx->mutex locked
 static void output_data_reset(struct output_data *data)
 {
-    if (data->buffer) {
-        wl_buffer_destroy(data->buffer);
-        data->buffer = NULL;
-    }
-    if (data->buffer_data) {
-        munmap(data->buffer_data, data->buffer_stride * data->buffer_height);
-        data->buffer_data = NULL;
+    for (int i = 0; i < 2; ++i) {
+        if (data->buffers[i]) {
+            wl_buffer_destroy(data->buffers[i]);
+            data->buffers[i] = NULL;
+        }
+        if (data->buffer_data[i]) {
+            munmap(data->buffer_data[i], data->buffer_stride * data->buffer_height);
+            data->buffer_data[i] = NULL;
+        }
     }
     if (data->session) {
         ext_screencopy_session_v1_destroy(data->session);
         data->session = NULL;
     }
-    if (data->tex) {
-        gs_texture_destroy(data->tex);
-        data->tex = NULL;
-    }
+    data->back = 0;
+    data->front = -1;
     data->damaged = false;
     data->have_cursor = false;
 }
@@ -86,12 +101,10 @@ static struct wl_buffer *create_shm_buffer(struct wl_shm *shm,
 {
     int size = stride * height;
 
-    const char shm_name[] = "/obs-vkcapture-wlshm";
-    int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    int fd = memfd_create("obs-vkcapture-wlshm", MFD_CLOEXEC);
     if (fd < 0) {
         return NULL;
     }
-    shm_unlink(shm_name);
 
     int ret;
     while ((ret = ftruncate(fd, size)) == EINTR) { }
@@ -135,20 +148,24 @@ static void session_handle_cursor_buffer_info(void *data_,
         return;
     }
 
-    if (data->buffer) {
+    if (data->buffers[0]) {
         return;
     }
 
     data->buffer_width = width;
     data->buffer_height = height;
     data->buffer_stride = stride;
-    data->buffer = create_shm_buffer(data->ctx->shm,
-            drm_format_to_wl_shm(format), data->buffer_width,
-            data->buffer_height, data->buffer_stride, &data->buffer_data);
-    if (!data->buffer) {
-        blog(LOG_ERROR, "failed to create shm buffer");
-    } else {
-        data->tex = gs_texture_create(width, height, GS_BGRA, 1, NULL, GS_DYNAMIC);
+    for (int i = 0; i < 2; ++i) {
+        data->buffers[i] = create_shm_buffer(data->ctx->shm,
+                drm_format_to_wl_shm(format), data->buffer_width,
+                data->buffer_height, data->buffer_stride, &data->buffer_data[i]);
+        if (!data->buffers[i]) {
+            blog(LOG_ERROR, "failed to create shm buffer");
+            pthread_mutex_lock(&data->ctx->mutex);
+            output_data_reset(data);
+            pthread_mutex_unlock(&data->ctx->mutex);
+            return;
+        }
     }
 }
 
@@ -157,13 +174,13 @@ static void session_handle_init_done(void *data_,
 {
     struct output_data *data = data_;
 
-    if (!data->buffer) {
+    if (!data->buffers[0]) {
         blog(LOG_ERROR, "no available shm buffers");
         return;
     }
 
     ext_screencopy_session_v1_attach_cursor_buffer(session,
-            data->buffer, NULL,
+            data->buffers[data->back], NULL,
             EXT_SCREENCOPY_SESSION_V1_INPUT_TYPE_POINTER);
     ext_screencopy_session_v1_damage_cursor_buffer(session,
             NULL, EXT_SCREENCOPY_SESSION_V1_INPUT_TYPE_POINTER);
@@ -186,10 +203,10 @@ static void session_handle_cursor_info(void *data_,
 {
     struct output_data *data = data_;
 
-    data->pos_x = pos_x;
-    data->pos_y = pos_y;
-    data->hotspot_x = hotspot_x;
-    data->hotspot_y = hotspot_y;
+    data->next_pos_x = pos_x;
+    data->next_pos_y = pos_y;
+    data->next_hotspot_x = hotspot_x;
+    data->next_hotspot_y = hotspot_y;
     data->damaged = damaged;
 }
 
@@ -198,7 +215,9 @@ static void session_handle_cursor_enter(void *data_,
         const char *seat_name, uint32_t input_type)
 {
     struct output_data *data = data_;
+    pthread_mutex_lock(&data->ctx->mutex);
     data->have_cursor = true;
+    pthread_mutex_unlock(&data->ctx->mutex);
 }
 
 static void session_handle_cursor_leave(void *data_,
@@ -206,7 +225,9 @@ static void session_handle_cursor_leave(void *data_,
         const char *seat_name, uint32_t input_type)
 {
     struct output_data *data = data_;
+    pthread_mutex_lock(&data->ctx->mutex);
     data->have_cursor = false;
+    pthread_mutex_unlock(&data->ctx->mutex);
 }
 
 static void session_handle_transform(void *data,
@@ -224,14 +245,33 @@ static void session_handle_ready(void *data_,
     struct ext_screencopy_session_v1 *session)
 {
     struct output_data *data = data_;
+    wl_cursor_t *ctx = data->ctx;
+
+    // Back buffer belongs to this thread until published, hash it unlocked
+    const bool swap = data->damaged || data->front < 0;
+    uint64_t hash = 0;
+    if (swap) {
+        hash = cursor_cache_hash(data->buffer_data[data->back],
+                data->buffer_width, data->buffer_height, data->buffer_stride);
+    }
 
-    if (data->damaged) {
-        gs_texture_set_image(data->tex, data->buffer_data,
-                data->buffer_stride, false);
+    // Render copies the front buffer with the mutex held, so the old one
+    // can be given back to the compositor right away
+    pthread_mutex_lock(&ctx->mutex);
+    if (swap) {
+        data->front = data->back;
+        data->back = !data->back;
+        data->hash = hash;
     }
+    data->pos_x = data->next_pos_x;
+    data->pos_y = data->next_pos_y;
+    data->hotspot_x = data->next_hotspot_x;
+    data->hotspot_y = data->next_hotspot_y;
+    data->serial = ++ctx->serial;
+    pthread_mutex_unlock(&ctx->mutex);
 
     ext_screencopy_session_v1_attach_cursor_buffer(session,
-            data->buffer, NULL,
+            data->buffers[data->back], NULL,
             EXT_SCREENCOPY_SESSION_V1_INPUT_TYPE_POINTER);
     ext_screencopy_session_v1_damage_cursor_buffer(session,
             NULL, EXT_SCREENCOPY_SESSION_V1_INPUT_TYPE_POINTER);
@@ -244,7 +284,9 @@ static void session_handle_failed(void *data_,
     enum ext_screencopy_session_v1_failure_reason reason)
 {
     struct output_data *data = data_;
+    pthread_mutex_lock(&data->ctx->mutex);
     output_data_reset(data);
+    pthread_mutex_unlock(&data->ctx->mutex);
 
     if (reason == EXT_SCREENCOPY_SESSION_V1_FAILURE_REASON_OUTPUT_DISABLED) {
         capture_output(data);
@@ -288,6 +330,7 @@ static void handle_global(void *data, struct wl_registry *registry,
         struct output_data *output_data = bzalloc(sizeof(struct output_data));
         output_data->ctx = ctx;
         output_data->id = name;
+        output_data->front = -1;
         output_data->output = wl_registry_bind(registry, name, &wl_output_interface, 1);
         da_push_back(ctx->outputs, &output_data);
         capture_output(output_data);
@@ -307,9 +350,12 @@ static void handle_global_remove(void *data, struct wl_registry *registry,
     for (size_t i = 0; i < ctx->outputs.num; ++i) {
         struct output_data *o = *(ctx->outputs.array + i);
         if (o->id == name) {
+            pthread_mutex_lock(&ctx->mutex);
             output_data_reset(o);
-            bfree(o);
             da_erase(ctx->outputs, i);
+            pthread_mutex_unlock(&ctx->mutex);
+            wl_output_destroy(o->output);
+            bfree(o);
             break;
         }
     }
@@ -320,15 +366,71 @@ static const struct wl_registry_listener registry_listener = {
     .global_remove = handle_global_remove,
 };
 
+static void *cursor_thread_run(void *data_)
+{
+    wl_cursor_t *data = data_;
+
+    struct pollfd fds[2] = {
+        {.fd = wl_display_get_fd(data->display), .events = POLLIN},
+        {.fd = data->wakefd, .events = POLLIN},
+    };
+
+    while (!atomic_load(&data->quit)) {
+        while (wl_display_prepare_read_queue(data->display, data->queue) != 0) {
+            wl_display_dispatch_queue_pending(data->display, data->queue);
+        }
+        wl_display_flush(data->display);
+
+        if (poll(fds, 2, -1) < 0) {
+            wl_display_cancel_read(data->display);
+            if (errno == EINTR) {
+                continue;
+            }
+            blog(LOG_ERROR, "Wayland cursor poll error: %s", strerror(errno));
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            if (wl_display_read_events(data->display) < 0) {
+                blog(LOG_ERROR, "Wayland cursor lost display connection");
+                break;
+            }
+        } else {
+            wl_display_cancel_read(data->display);
+        }
+
+        if (fds[1].revents & POLLIN) {
+            uint64_t value;
+            if (read(data->wakefd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                break;
+            }
+        }
+
+        wl_display_dispatch_queue_pending(data->display, data->queue);
+    }
+
+    return NULL;
+}
+
 wl_cursor_t *wl_cursor_init(struct wl_display *display)
 {
     wl_cursor_t *data = bzalloc(sizeof(wl_cursor_t));
 
     da_init(data->outputs);
+    pthread_mutex_init(&data->mutex, NULL);
+    data->cache = cursor_cache_create();
+    data->display = display;
+    data->wakefd = -1;
 
-    struct wl_registry *registry = wl_display_get_registry(display);
-    wl_registry_add_listener(registry, &registry_listener, data);
-    wl_display_roundtrip(display);
+    // Objects created from the registry inherit the private queue
+    data->queue = wl_display_create_queue(display);
+    struct wl_display *wrapper = wl_proxy_create_wrapper(display);
+    wl_proxy_set_queue((struct wl_proxy *)wrapper, data->queue);
+    data->registry = wl_display_get_registry(wrapper);
+    wl_proxy_wrapper_destroy(wrapper);
+
+    wl_registry_add_listener(data->registry, &registry_listener, data);
+    wl_display_roundtrip_queue(display, data->queue);
 
     if (!data->shm) {
         blog(LOG_ERROR, "wl_shm not available");
@@ -346,33 +448,91 @@ wl_cursor_t *wl_cursor_init(struct wl_display *display)
         capture_output(*(data->outputs.array + i));
     }
 
+    data->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (data->wakefd < 0
+        || pthread_create(&data->thread, NULL, cursor_thread_run, data) != 0) {
+        blog(LOG_ERROR, "Failed to create Wayland cursor thread");
+        wl_cursor_destroy(data);
+        return NULL;
+    }
+    pthread_setname_np(data->thread, "vkcapture-wlcur");
+
     return data;
 }
 
 void wl_cursor_destroy(wl_cursor_t *data)
 {
+    if (data->thread) {
+        atomic_store(&data->quit, true);
+        const uint64_t value = 1;
+        if (write(data->wakefd, &value, sizeof(value)) < 0) {
+            blog(LOG_WARNING, "Failed to wake Wayland cursor thread");
+        }
+        pthread_join(data->thread, NULL);
+    }
+    if (data->wakefd >= 0) {
+        close(data->wakefd);
+    }
+
     for (size_t i = 0; i < data->outputs.num; ++i) {
         struct output_data *output_data = *(data->outputs.array + i);
+        pthread_mutex_lock(&data->mutex);
         output_data_reset(output_data);
+        pthread_mutex_unlock(&data->mutex);
+        wl_output_destroy(output_data->output);
         bfree(output_data);
     }
     da_free(data->outputs);
+
+    if (data->screencopy) {
+        ext_screencopy_manager_v1_destroy(data->screencopy);
+    }
+    if (data->shm) {
+        wl_shm_destroy(data->shm);
+    }
+    wl_registry_destroy(data->registry);
+    wl_display_flush(data->display);
+    wl_event_queue_destroy(data->queue);
+
+    cursor_cache_destroy(data->cache);
+    pthread_mutex_destroy(&data->mutex);
     bfree(data);
 }
 
 void wl_cursor_render(wl_cursor_t *data)
 {
+    pthread_mutex_lock(&data->mutex);
+
     struct output_data *output_data = NULL;
 
     for (size_t i = 0; i < data->outputs.num; ++i) {
         struct output_data *o = *(data->outputs.array + i);
-        if (o->have_cursor && o->tex) {
+        if (o->have_cursor && o->front >= 0) {
             output_data = o;
             break;
         }
     }
 
     if (!output_data) {
+        pthread_mutex_unlock(&data->mutex);
+        return;
+    }
+
+    // Serial changes with position too, the image is found by its hash
+    if (data->tex_serial != output_data->serial) {
+        data->tex = cursor_cache_get(data->cache, 0, output_data->hash,
+                output_data->buffer_data[output_data->front],
+                output_data->buffer_width, output_data->buffer_height,
+                output_data->buffer_stride);
+        data->tex_serial = output_data->serial;
+    }
+
+    const float x = output_data->pos_x - output_data->hotspot_x;
+    const float y = output_data->pos_y - output_data->hotspot_y;
+
+    pthread_mutex_unlock(&data->mutex);
+
+    if (!data->tex) {
         return;
     }
 
@@ -384,18 +544,17 @@ void wl_cursor_render(wl_cursor_t *data)
     gs_effect_t *effect = gs_get_effect();
     gs_eparam_t *image = gs_effect_get_param_by_name(effect, "image");
     if (linear_srgb)
-        gs_effect_set_texture_srgb(image, output_data->tex);
+        gs_effect_set_texture_srgb(image, data->tex);
     else
-        gs_effect_set_texture(image, output_data->tex);
+        gs_effect_set_texture(image, data->tex);
 
     gs_blend_state_push();
     gs_blend_function(GS_BLEND_SRCALPHA, GS_BLEND_INVSRCALPHA);
     gs_enable_color(true, true, true, false);
 
     gs_matrix_push();
-    gs_matrix_translate3f(output_data->pos_x - output_data->hotspot_x,
-            output_data->pos_y - output_data->hotspot_y, 0.0f);
-    gs_draw_sprite(output_data->tex, 0, 0, 0);
+    gs_matrix_translate3f(x, y, 0.0f);
+    gs_draw_sprite(data->tex, 0, 0, 0);
     gs_matrix_pop();
 
     gs_enable_color(true, true, true, true);
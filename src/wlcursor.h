@@ -19,14 +19,33 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #pragma once
 
 #include <obs.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <wayland-client.h>
 
 #include "screencopy_unstable_v1.h"
+#include "cursor-cache.h"
 
+/* Screencopy sessions run on their own thread and event queue, render only
+ * uploads the latest published cursor image. */
 typedef struct {
+    struct wl_display *display;
+    struct wl_event_queue *queue;
+    struct wl_registry *registry;
     struct wl_shm *shm;
     struct ext_screencopy_manager_v1 *screencopy;
     DARRAY(struct output_data*) outputs;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    int wakefd;
+    atomic_bool quit;
+    uint64_t serial;
+
+    // Graphics thread only
+    cursor_cache_t *cache;
+    gs_texture_t *tex;
+    uint64_t tex_serial;
 } wl_cursor_t;
 
 wl_cursor_t *wl_cursor_init(struct wl_display *display);
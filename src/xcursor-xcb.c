@@ -15,77 +15,453 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
+
 #include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
 #include <xcb/xfixes.h>
 
 #include <util/bmem.h>
+#include <util/darray.h>
 #include "xcursor-xcb.h"
+#include "plugin-macros.h"
+
+#if HAVE_XCB_XINPUT
+#include <xcb/xinput.h>
+#endif
+
+// Pointer position is polled at this interval without XInput2 motion events
+#define TRACKER_POLL_MS 8
+
+struct tracked_window {
+    xcb_window_t id;
+    int refs;
+    bool dirty;
+    int x;
+    int y;
+};
 
 /*
- * Create the cursor texture, either by updating if the new cursor has the same
- * size or by creating a new texture if the size is different
+ * Cursor state shared by all sources, kept up to date by tracker thread so
+ * rendering never waits for X server
  */
-static void xcb_xcursor_create(xcb_xcursor_t *data,
-        xcb_xfixes_get_cursor_image_reply_t *xc)
+static struct {
+    pthread_mutex_t start_mutex;
+    int refs;
+    pthread_mutex_t mutex;
+    pthread_t thread;
+    int wakefd;
+    atomic_bool quit;
+    xcb_connection_t *xcb;
+    xcb_window_t root;
+    uint8_t xfixes_event;
+    uint8_t xinput_opcode;
+
+    unsigned int serial;
+    uint64_t hash;
+    uint32_t *pixels;
+    uint16_t width;
+    uint16_t height;
+    uint16_t xhot;
+    uint16_t yhot;
+    int x;
+    int y;
+    DARRAY(struct tracked_window) windows;
+} tracker = {
+    .start_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .wakefd = -1,
+};
+
+static struct tracked_window *tracker_find_window(xcb_window_t id)
+{
+    for (size_t i = 0; i < tracker.windows.num; ++i) {
+        if (tracker.windows.array[i].id == id)
+            return &tracker.windows.array[i];
+    }
+    return NULL;
+}
+
+static void tracker_wakeup(void)
+{
+    const uint64_t value = 1;
+    if (write(tracker.wakefd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        blog(LOG_WARNING, "Failed to wake cursor tracker");
+}
+
+static void tracker_update_image(void)
 {
-    uint32_t *pixels = xcb_xfixes_get_cursor_image_cursor_image(xc);
-    if (!pixels)
+    xcb_xfixes_get_cursor_image_cookie_t cur_c =
+        xcb_xfixes_get_cursor_image_unchecked(tracker.xcb);
+    xcb_xfixes_get_cursor_image_reply_t *cur_r =
+        xcb_xfixes_get_cursor_image_reply(tracker.xcb, cur_c, NULL);
+    if (!cur_r)
         return;
 
-    if (data->tex && data->last_height == xc->width &&
-            data->last_width == xc->height) {
-        gs_texture_set_image(data->tex, (const uint8_t *)pixels,
-                xc->width * sizeof(uint32_t), false);
-    } else {
-        if (data->tex)
-            gs_texture_destroy(data->tex);
+    const uint32_t *pixels = xcb_xfixes_get_cursor_image_cursor_image(cur_r);
+    const size_t size = cur_r->width * cur_r->height * sizeof(uint32_t);
 
-        data->tex = gs_texture_create(xc->width, xc->height, GS_BGRA, 1,
-                (const uint8_t **)&pixels,
-                GS_DYNAMIC);
+    pthread_mutex_lock(&tracker.mutex);
+    if (pixels && (!tracker.pixels || tracker.serial != cur_r->cursor_serial)) {
+        tracker.pixels = brealloc(tracker.pixels, size);
+        memcpy(tracker.pixels, pixels, size);
+        tracker.serial = cur_r->cursor_serial;
+        tracker.hash = cursor_cache_hash((const uint8_t *)pixels, cur_r->width,
+                cur_r->height, cur_r->width * sizeof(uint32_t));
+        tracker.width = cur_r->width;
+        tracker.height = cur_r->height;
+        tracker.xhot = cur_r->xhot;
+        tracker.yhot = cur_r->yhot;
     }
+    tracker.x = cur_r->x;
+    tracker.y = cur_r->y;
+    pthread_mutex_unlock(&tracker.mutex);
 
-    data->last_serial = xc->cursor_serial;
-    data->last_width = xc->width;
-    data->last_height = xc->height;
+    free(cur_r);
 }
 
-/**
- * We need to check for the xfixes version in order to initialize it ?
- */
-xcb_xcursor_t *xcb_xcursor_init(xcb_connection_t *xcb)
+static void tracker_update_pointer(void)
 {
-    xcb_xcursor_t *data = bzalloc(sizeof(xcb_xcursor_t));
+    xcb_query_pointer_cookie_t ptr_c =
+        xcb_query_pointer_unchecked(tracker.xcb, tracker.root);
+    xcb_query_pointer_reply_t *ptr_r =
+        xcb_query_pointer_reply(tracker.xcb, ptr_c, NULL);
+    if (!ptr_r)
+        return;
+
+    pthread_mutex_lock(&tracker.mutex);
+    tracker.x = ptr_r->root_x;
+    tracker.y = ptr_r->root_y;
+    pthread_mutex_unlock(&tracker.mutex);
+
+    free(ptr_r);
+}
+
+static void tracker_update_windows(void)
+{
+    DARRAY(xcb_window_t) ids;
+    da_init(ids);
+
+    pthread_mutex_lock(&tracker.mutex);
+    for (size_t i = 0; i < tracker.windows.num; ++i) {
+        struct tracked_window *w = &tracker.windows.array[i];
+        if (w->dirty) {
+            da_push_back(ids, &w->id);
+            w->dirty = false;
+        }
+    }
+    pthread_mutex_unlock(&tracker.mutex);
 
-    xcb_xfixes_query_version_cookie_t xfix_c;
+    if (!ids.num) {
+        da_free(ids);
+        return;
+    }
+
+    // Window managers send synthetic ConfigureNotify when moving the frame
+    const uint32_t mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+    xcb_translate_coordinates_cookie_t *tr_c =
+        bmalloc(ids.num * sizeof(xcb_translate_coordinates_cookie_t));
+    for (size_t i = 0; i < ids.num; ++i) {
+        xcb_change_window_attributes(tracker.xcb, ids.array[i], XCB_CW_EVENT_MASK, &mask);
+        tr_c[i] = xcb_translate_coordinates_unchecked(tracker.xcb, ids.array[i],
+                tracker.root, 0, 0);
+    }
+
+    for (size_t i = 0; i < ids.num; ++i) {
+        xcb_translate_coordinates_reply_t *tr_r =
+            xcb_translate_coordinates_reply(tracker.xcb, tr_c[i], NULL);
+        if (!tr_r)
+            continue;
+
+        pthread_mutex_lock(&tracker.mutex);
+        struct tracked_window *w = tracker_find_window(ids.array[i]);
+        if (w) {
+            w->x = tr_r->dst_x;
+            w->y = tr_r->dst_y;
+        }
+        pthread_mutex_unlock(&tracker.mutex);
+
+        free(tr_r);
+    }
+
+    bfree(tr_c);
+    da_free(ids);
+}
+
+static void *tracker_thread_run(void *data)
+{
+    UNUSED_PARAMETER(data);
 
-    xfix_c = xcb_xfixes_query_version_unchecked(
-            xcb, XCB_XFIXES_MAJOR_VERSION, XCB_XFIXES_MINOR_VERSION);
-    free(xcb_xfixes_query_version_reply(xcb, xfix_c, NULL));
+    struct pollfd fds[2] = {
+        {.fd = xcb_get_file_descriptor(tracker.xcb), .events = POLLIN},
+        {.fd = tracker.wakefd, .events = POLLIN},
+    };
 
+    tracker_update_image();
+
+    while (!atomic_load(&tracker.quit)) {
+        xcb_flush(tracker.xcb);
+
+        const int timeout = tracker.xinput_opcode ? -1 : TRACKER_POLL_MS;
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+            blog(LOG_ERROR, "Cursor tracker poll error: %s", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            uint64_t value;
+            if (read(tracker.wakefd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+                break;
+        }
+
+        bool image = false;
+        bool motion = !tracker.xinput_opcode;
+        xcb_generic_event_t *ev;
+        while ((ev = xcb_poll_for_event(tracker.xcb))) {
+            const uint8_t type = ev->response_type & ~0x80;
+            if (type == tracker.xfixes_event + XCB_XFIXES_CURSOR_NOTIFY) {
+                image = true;
+            } else if (type == XCB_GE_GENERIC) {
+                // Only XInput2 raw motion is selected
+                motion = true;
+            } else if (type == XCB_CONFIGURE_NOTIFY) {
+                const xcb_configure_notify_event_t *cfg =
+                    (const xcb_configure_notify_event_t *)ev;
+                pthread_mutex_lock(&tracker.mutex);
+                struct tracked_window *w = tracker_find_window(cfg->window);
+                if (w)
+                    w->dirty = true;
+                pthread_mutex_unlock(&tracker.mutex);
+            }
+            free(ev);
+        }
+
+        if (xcb_connection_has_error(tracker.xcb)) {
+            blog(LOG_ERROR, "Cursor tracker lost X connection");
+            break;
+        }
+
+        // Cursor image reply also has the pointer position
+        if (image)
+            tracker_update_image();
+        else if (motion)
+            tracker_update_pointer();
+
+        tracker_update_windows();
+    }
+
+    return NULL;
+}
+
+static void tracker_cleanup(void)
+{
+    if (tracker.wakefd >= 0) {
+        close(tracker.wakefd);
+        tracker.wakefd = -1;
+    }
+    if (tracker.xcb) {
+        xcb_disconnect(tracker.xcb);
+        tracker.xcb = NULL;
+    }
+    bfree(tracker.pixels);
+    tracker.pixels = NULL;
+    tracker.xinput_opcode = 0;
+    da_free(tracker.windows);
+}
+
+static bool tracker_start(void)
+{
+    tracker.xcb = xcb_connect(NULL, NULL);
+    if (!tracker.xcb || xcb_connection_has_error(tracker.xcb)) {
+        blog(LOG_ERROR, "Unable to open X display!");
+        tracker_cleanup();
+        return false;
+    }
+    tracker.root = xcb_setup_roots_iterator(xcb_get_setup(tracker.xcb)).data->root;
+
+    const xcb_query_extension_reply_t *xfixes =
+        xcb_get_extension_data(tracker.xcb, &xcb_xfixes_id);
+    if (!xfixes || !xfixes->present) {
+        blog(LOG_ERROR, "XFixes extension not available");
+        tracker_cleanup();
+        return false;
+    }
+    tracker.xfixes_event = xfixes->first_event;
+
+    xcb_xfixes_query_version_cookie_t xfix_c = xcb_xfixes_query_version_unchecked(
+            tracker.xcb, XCB_XFIXES_MAJOR_VERSION, XCB_XFIXES_MINOR_VERSION);
+    free(xcb_xfixes_query_version_reply(tracker.xcb, xfix_c, NULL));
+    xcb_xfixes_select_cursor_input(tracker.xcb, tracker.root,
+            XCB_XFIXES_CURSOR_NOTIFY_MASK_DISPLAY_CURSOR);
+
+#if HAVE_XCB_XINPUT
+    const xcb_query_extension_reply_t *xinput =
+        xcb_get_extension_data(tracker.xcb, &xcb_input_id);
+    if (xinput && xinput->present) {
+        xcb_input_xi_query_version_cookie_t ver_c =
+            xcb_input_xi_query_version(tracker.xcb, 2, 0);
+        xcb_input_xi_query_version_reply_t *ver_r =
+            xcb_input_xi_query_version_reply(tracker.xcb, ver_c, NULL);
+        if (ver_r && ver_r->major_version >= 2) {
+            // Raw events are always delivered to root window
+            struct {
+                xcb_input_event_mask_t head;
+                uint32_t mask;
+            } mask = {
+                .head = {
+                    .deviceid = XCB_INPUT_DEVICE_ALL_MASTER,
+                    .mask_len = 1,
+                },
+                .mask = XCB_INPUT_XI_EVENT_MASK_RAW_MOTION,
+            };
+            xcb_input_xi_select_events(tracker.xcb, tracker.root, 1, &mask.head);
+            tracker.xinput_opcode = xinput->major_opcode;
+        }
+        free(ver_r);
+    }
+#endif
+    if (!tracker.xinput_opcode)
+        blog(LOG_INFO, "XInput2 not available, polling cursor position");
+
+    atomic_store(&tracker.quit, false);
+    tracker.wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (tracker.wakefd < 0 ||
+            pthread_create(&tracker.thread, NULL, tracker_thread_run, NULL) != 0) {
+        blog(LOG_ERROR, "Failed to create cursor tracker thread");
+        tracker_cleanup();
+        return false;
+    }
+    pthread_setname_np(tracker.thread, "vkcapture-xcur");
+
+    return true;
+}
+
+static void tracker_stop(void)
+{
+    atomic_store(&tracker.quit, true);
+    tracker_wakeup();
+    pthread_join(tracker.thread, NULL);
+    tracker_cleanup();
+}
+
+static void tracker_watch(xcb_window_t id)
+{
+    if (!id)
+        return;
+
+    pthread_mutex_lock(&tracker.mutex);
+    struct tracked_window *w = tracker_find_window(id);
+    if (w) {
+        w->refs++;
+    } else {
+        w = da_push_back_new(tracker.windows);
+        w->id = id;
+        w->refs = 1;
+        w->dirty = true;
+    }
+    pthread_mutex_unlock(&tracker.mutex);
+
+    tracker_wakeup();
+}
+
+static void tracker_unwatch(xcb_window_t id)
+{
+    if (!id)
+        return;
+
+    pthread_mutex_lock(&tracker.mutex);
+    struct tracked_window *w = tracker_find_window(id);
+    if (w && --w->refs == 0)
+        da_erase(tracker.windows, w - tracker.windows.array);
+    pthread_mutex_unlock(&tracker.mutex);
+}
+
+xcb_xcursor_t *xcb_xcursor_init(void)
+{
+    pthread_mutex_lock(&tracker.start_mutex);
+    const bool started = tracker.refs || tracker_start();
+    if (started)
+        tracker.refs++;
+    pthread_mutex_unlock(&tracker.start_mutex);
+
+    if (!started)
+        return NULL;
+
+    xcb_xcursor_t *data = bzalloc(sizeof(xcb_xcursor_t));
+    data->cache = cursor_cache_create();
     return data;
 }
 
 void xcb_xcursor_destroy(xcb_xcursor_t *data)
 {
-    if (data->tex)
-        gs_texture_destroy(data->tex);
+    tracker_unwatch(data->window);
+
+    cursor_cache_destroy(data->cache);
+    bfree(data->pixels);
     bfree(data);
+
+    pthread_mutex_lock(&tracker.start_mutex);
+    if (--tracker.refs == 0)
+        tracker_stop();
+    pthread_mutex_unlock(&tracker.start_mutex);
 }
 
-void xcb_xcursor_update(xcb_xcursor_t *data,
-        xcb_xfixes_get_cursor_image_reply_t *xc)
+void xcb_xcursor_update(xcb_xcursor_t *data, xcb_window_t window)
 {
-    if (!data || !xc)
+    if (!data)
         return;
 
-    if (!data->tex || data->last_serial != xc->cursor_serial)
-        xcb_xcursor_create(data, xc);
+    if (data->window != window) {
+        tracker_unwatch(data->window);
+        tracker_watch(window);
+        data->window = window;
+    }
+
+    pthread_mutex_lock(&tracker.mutex);
+
+    // Image is copied out, so the tracker never waits for the upload
+    const bool changed = tracker.pixels && (!data->tex || data->last_serial != tracker.serial);
+    const unsigned int serial = tracker.serial;
+    const uint64_t hash = tracker.hash;
+    const uint32_t width = tracker.width;
+    const uint32_t height = tracker.height;
+    if (changed) {
+        const size_t size = width * height * sizeof(uint32_t);
+        if (data->pixels_size < size) {
+            data->pixels = brealloc(data->pixels, size);
+            data->pixels_size = size;
+        }
+        memcpy(data->pixels, tracker.pixels, size);
+    }
 
-    data->x = xc->x - data->x_org;
-    data->y = xc->y - data->y_org;
-    data->x_render = data->x - xc->xhot;
-    data->y_render = data->y - xc->yhot;
+    int win_x = 0;
+    int win_y = 0;
+    const struct tracked_window *w = tracker_find_window(window);
+    if (w) {
+        win_x = w->x;
+        win_y = w->y;
+    }
+
+    data->x = tracker.x - win_x - data->x_org;
+    data->y = tracker.y - win_y - data->y_org;
+    data->x_render = data->x - tracker.xhot;
+    data->y_render = data->y - tracker.yhot;
+
+    pthread_mutex_unlock(&tracker.mutex);
+
+    // Cursor shapes seen before are already in the cache
+    if (changed) {
+        data->tex = cursor_cache_get(data->cache, serial, hash,
+                (const uint8_t *)data->pixels, width, height,
+                width * sizeof(uint32_t));
+        data->last_serial = serial;
+    }
 }
 
 void xcb_xcursor_render(xcb_xcursor_t *data)
@@ -20,16 +20,20 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <obs.h>
 #include <xcb/xfixes.h>
 
+#include "cursor-cache.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef struct {
     unsigned int last_serial;
-    unsigned int last_width;
-    unsigned int last_height;
+    cursor_cache_t *cache;
     gs_texture_t *tex;
+    uint32_t *pixels;
+    size_t pixels_size;
 
+    xcb_window_t window;
     int x;
     int y;
     int x_org;
@@ -41,9 +45,12 @@ typedef struct {
 /**
  * Initializes the xcursor object
  *
+ * All xcursor objects share one tracker thread with its own X connection,
+ * which follows cursor changes, pointer motion and window moves.
+ *
  * @return NULL on error
  */
-xcb_xcursor_t *xcb_xcursor_init(xcb_connection_t *xcb);
+xcb_xcursor_t *xcb_xcursor_init(void);
 
 /**
  * Destroys the xcursor object
@@ -52,15 +59,14 @@ xcb_xcursor_t *xcb_xcursor_init(xcb_connection_t *xcb);
 void xcb_xcursor_destroy(xcb_xcursor_t *data);
 
 /**
- * Update the cursor data
+ * Update the cursor data from the latest tracker state
  * @param data xcursor object
- * @param xc xcb cursor image reply
+ * @param window captured window, cursor is relative to it (0 = root)
  *
  * @note This needs to be executed within a valid render context
  *
  */
-void xcb_xcursor_update(xcb_xcursor_t *data,
-        xcb_xfixes_get_cursor_image_reply_t *xc);
+void xcb_xcursor_update(xcb_xcursor_t *data, xcb_window_t window);
 
 /**
  * Draw the cursor